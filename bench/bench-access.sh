@@ -0,0 +1,19 @@
+#!/bin/sh
+# Reaching an item of a list through the name it is bound to should not
+# depend on the size of the list: bind lists of 1k, 10k and 100k items
+# and take the first item 100 times. Reading the literal alone is timed
+# for comparison.
+
+. bench/lib.sh
+
+for n in 1000 10000 100000; do
+    awk -v n=$n 'BEGIN {
+        printf "(def {l} {"
+        for (i = 0; i < n; i++) printf "%d ", i + 1
+        print "})"
+    }' > "$TMP/list$n.lispx"
+
+    bench "read a $n-item list" "$TMP/list$n.lispx"
+    bench "read it, 100 x (fst l)" "$TMP/list$n.lispx" \
+          "$TOP/bench/access.lispx"
+done
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Arithmetic builtins dispatch on their operator once per call and fold
+# their arguments in place: time 20M calls of (+ 1 2), and 50 calls of
+# (unpack + big) on a 1M-item list. Reading the list alone is timed for
+# comparison.
+
+. bench/lib.sh
+
+awk 'BEGIN {
+    printf "(def {big} {"
+    for (i = 0; i < 1000000; i++) printf "%d ", i % 1000
+    print "})"
+}' > "$TMP/big.lispx"
+echo '(print (add 20000000 0))' > "$TMP/add.lispx"
+echo '(print (sum 50 0))' > "$TMP/sum.lispx"
+
+bench "20M x (+ 1 2)" "$TOP/bench/arith.lispx" "$TMP/add.lispx"
+bench "read a 1M-item list" "$TMP/big.lispx"
+bench "read it, 50 x (unpack + big)" "$TMP/big.lispx" \
+      "$TOP/bench/arith.lispx" "$TMP/sum.lispx"
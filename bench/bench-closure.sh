@@ -0,0 +1,22 @@
+#!/bin/sh
+# A call binds its arguments into a fresh frame and leaves the function
+# as it was, so calling a partial application neither copies it nor the
+# list it holds: read a 65k-item list, then make 1M calls of a partial
+# application over it, and 1M calls that each build one first.
+
+. bench/lib.sh
+
+awk 'BEGIN {
+    printf "(def {big} {"
+    for (i = 0; i < 65536; i++) printf "%d ", i
+    print "})"
+}' > "$TMP/big.lispx"
+echo '(print (call-g 1000000 0))' > "$TMP/g.lispx"
+echo '(print (call-pick 1000000 0))' > "$TMP/pick.lispx"
+
+bench "read a 65k-item list" "$TMP/big.lispx"
+for f in g pick; do
+    set -- "$TMP/big.lispx" "$TOP/bench/closure.lispx" "$TMP/$f.lispx"
+    bench "read it, (call-$f 1000000 0)" "$@"
+    bench_stat "read it, (call-$f 1000000 0), lvals" lval-allocs "$@"
+done
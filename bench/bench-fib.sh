@@ -0,0 +1,9 @@
+#!/bin/sh
+# (fib 25): the time it takes, and how many lvals it allocates, counted
+# by (gc-stats {lval-allocs}). Numbers are tagged immediates, so the
+# count is down to argument lists and frames.
+
+. bench/lib.sh
+
+bench "(fib 25)" "$TOP/bench/fib.lispx"
+bench_stat "(fib 25), lvals allocated" lval-allocs "$TOP/bench/fib.lispx"
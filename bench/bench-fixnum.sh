@@ -0,0 +1,13 @@
+#!/bin/sh
+# Integers overflow into bignums, but a fixnum result costs only an
+# overflow check, so code that stays within fixnums keeps its speed:
+# time 20M calls of (+ 1 2) and (fib 27), against a build from before
+# bignums when BASELINE is set.
+
+. bench/lib.sh
+
+echo '(print (add 20000000 0))' > "$TMP/add.lispx"
+echo '(print (fib 27))' > "$TMP/fib.lispx"
+
+bench "20M x (+ 1 2)" "$TOP/bench/arith.lispx" "$TMP/add.lispx"
+bench "(fib 27)" "$TOP/bench/arith.lispx" "$TMP/fib.lispx"
@@ -0,0 +1,18 @@
+#!/bin/sh
+# join should copy its arguments' items into one array sized up front,
+# so joining two 100k-item lists costs one pass over 200k items: read
+# the two lists, then join them 100 times. Reading alone is timed for
+# comparison.
+
+. bench/lib.sh
+
+awk 'BEGIN {
+    for (k = 0; k < 2; k++) {
+        printf "(def {%s} {", k ? "b" : "a"
+        for (i = 0; i < 100000; i++) printf "%d ", i
+        print "})"
+    }
+}' > "$TMP/join.lispx"
+
+bench "read 2 x 100k items" "$TMP/join.lispx"
+bench "read them, 100 x (join a b)" "$TMP/join.lispx" "$TOP/bench/join.lispx"
@@ -0,0 +1,29 @@
+#!/bin/sh
+# tail is an O(1) view and len and foldl are builtins, so both should
+# scale linearly: read lists of 10k, 100k and 1M items, then time
+# (len l) and (foldl + 0 l) on each, ten times over. Reading alone is
+# timed for comparison.
+
+. bench/lib.sh
+
+echo '(load "stdlib.lispx")' > "$TMP/stdlib.lispx"
+for f in "len l" "foldl + 0 l"; do
+    {
+        echo '(load "stdlib.lispx")'
+        echo "(fun {rep n} {if (== n 0) {0} {do ($f) (rep (- n 1))}})"
+        echo '(rep 10)'
+    } > "$TMP/${f%% *}.lispx"
+done
+
+for n in 10000 100000 1000000; do
+    awk -v n=$n 'BEGIN {
+        printf "(def {l} {"
+        for (i = 0; i < n; i++) printf "%d ", i
+        print "})"
+    }' > "$TMP/list$n.lispx"
+
+    bench "read a $n-item list" "$TMP/stdlib.lispx" "$TMP/list$n.lispx"
+    bench "read it, 10 x (len l)" "$TMP/list$n.lispx" "$TMP/len.lispx"
+    bench "read it, 10 x (foldl + 0 l)" "$TMP/list$n.lispx" \
+          "$TMP/foldl.lispx"
+done
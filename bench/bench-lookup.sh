@@ -0,0 +1,17 @@
+#!/bin/sh
+# Symbol lookup should not depend on how many definitions the global
+# environment holds: define 10 and 10k globals with (def {sN} N), then
+# resolve two of them 20k times.
+
+. bench/lib.sh
+
+for n in 10 10000; do
+    awk -v n=$n 'BEGIN {
+        for (i = 0; i < n; i++) printf "(def {s%d} %d)\n", i, i
+    }' > "$TMP/defs$n.lispx"
+done
+
+bench "load 10k defs" "$TMP/defs10000.lispx"
+bench "10 defs, 20k lookups" "$TMP/defs10.lispx" "$TOP/bench/lookup.lispx"
+bench "10k defs, 20k lookups" "$TMP/defs10000.lispx" \
+      "$TOP/bench/lookup.lispx"
@@ -0,0 +1,40 @@
+#!/bin/sh
+# The reader makes one pass over the source with no parse tree between
+# it and the values it builds: generate a 32 MB program with
+# tests/stream/generate.sh and time loading it, then reading the same
+# forms as Q-expressions, which evaluate to themselves, and report the
+# reading rate in MB/s and the peak resident size.
+#
+# The mpc reader this replaced (6b6923b^), against this script on the
+# machine the numbers came from, both built by make, best of three:
+#
+#                                              lispx       mpc
+#   load a 32.0 MB program                    1.314s   18.161s
+#   read it as Q-expressions                  1.152s   11.202s
+#     MB/s                                      27.8       2.9
+#   load it, peak resident KB                  17976   2564884
+#
+# That build has no rss-peak-kb statistic, so its figure is VmHWM from
+# /proc/PID/status.
+
+. bench/lib.sh
+
+sh tests/stream/generate.sh 32 > "$TMP/load.lispx"
+sed '1!s/^(def \(.*\))$/{def \1}/' "$TMP/load.lispx" > "$TMP/read.lispx"
+mb=$(wc -c < "$TMP/read.lispx" | awk '{printf "%.1f", $1 / 1048576}')
+
+# MB/s for a reading time of $1 seconds
+rate() {
+    case $1 in
+        -|"") echo "$1" ;;
+        *) awk -v t="$1" -v mb="$mb" 'BEGIN {printf "%.1f\n", mb / t}' ;;
+    esac
+}
+
+bench "load a $mb MB program" "$TMP/load.lispx"
+t=$(bench_time "$TOP" "$TMP/read.lispx")
+base=
+[ -n "$BASELINE" ] && base=$(bench_time "$BASELINE" "$TMP/read.lispx")
+printf '%-46s %9s %9s\n' "read it as Q-expressions" "$t" "$base"
+printf '%-46s %9s %9s\n' "  MB/s" "$(rate "$t")" "$(rate "$base")"
+bench_stat "load it, peak resident KB" rss-peak-kb "$TMP/load.lispx"
@@ -0,0 +1,26 @@
+#!/bin/sh
+# select, case, let and do are native forms that evaluate only the
+# clauses they need, so a loop built from them pays for no argument
+# lists: time 200k iterations that each do a select, a case, a let and
+# a do, and the cost of one iteration, then (fib 22), whose stdlib
+# definition is a select.
+
+. bench/lib.sh
+
+echo '(print (loop 200000 0))' > "$TMP/loop.lispx"
+echo '(print (fib 22))' > "$TMP/fib.lispx"
+
+set -- "$TOP/bench/select.lispx" "$TMP/loop.lispx"
+t=$(bench_time "$TOP" "$@")
+base=
+[ -n "$BASELINE" ] && base=$(bench_time "$BASELINE" "$@")
+printf '%-46s %9s %9s\n' "200k x select/case/let/do" "$t" "$base"
+# per iteration, in microseconds
+us() {
+    case $1 in
+        -|"") echo "$1" ;;
+        *) awk -v t="$1" 'BEGIN {printf "%.2f\n", t * 1e6 / 200000}' ;;
+    esac
+}
+printf '%-46s %9s %9s\n' "  one iteration, us" "$(us "$t")" "$(us "$base")"
+bench "(fib 22)" "$TOP/bench/select.lispx" "$TMP/fib.lispx"
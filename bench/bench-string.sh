@@ -0,0 +1,28 @@
+#!/bin/sh
+# A string builder doubles its buffer as it grows and str-join sizes
+# its result up front, so building a string from many small pieces is
+# linear: build 10 MB from 1M 10-byte pieces with str-add, and join 1M
+# such pieces read as a list. Repeated str-concat copies the string
+# each time, so it is timed on 20k and 40k pieces for comparison.
+
+. bench/lib.sh
+
+echo '(print (add (str-builder "") 1000000))' > "$TMP/add.lispx"
+echo '(print (concat "" 20000))' > "$TMP/concat20k.lispx"
+echo '(print (concat "" 40000))' > "$TMP/concat40k.lispx"
+awk 'BEGIN {
+    printf "(def {pieces} {"
+    for (i = 0; i < 1000000; i++) printf "\"0123456789\" "
+    print "})"
+}' > "$TMP/pieces.lispx"
+echo '(print (str-len (str-join "" pieces)))' > "$TMP/join.lispx"
+
+bench "1M x (str-add b \"0123456789\")" "$TOP/bench/string.lispx" \
+      "$TMP/add.lispx"
+bench "read 1M pieces" "$TMP/pieces.lispx"
+bench "read them, (str-join \"\" pieces)" "$TMP/pieces.lispx" \
+      "$TMP/join.lispx"
+bench "20k x (str-concat s \"0123456789\")" "$TOP/bench/string.lispx" \
+      "$TMP/concat20k.lispx"
+bench "40k x (str-concat s \"0123456789\")" "$TOP/bench/string.lispx" \
+      "$TMP/concat40k.lispx"
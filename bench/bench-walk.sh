@@ -0,0 +1,18 @@
+#!/bin/sh
+# Walking a large Q-expression touches every lval in it, so it shows
+# what the size of an lval costs in cache misses: read two lists of 300k
+# one-element lists, then compare them 100 times. Reading alone is
+# timed for comparison. lispx.c asserts that an lval fits in 64 bytes.
+
+. bench/lib.sh
+
+awk 'BEGIN {
+    for (k = 0; k < 2; k++) {
+        printf "(def {%s} {", k ? "b" : "a"
+        for (i = 0; i < 300000; i++) printf "{%d} ", i
+        print "})"
+    }
+}' > "$TMP/walk.lispx"
+
+bench "read 2 x 300k nested items" "$TMP/walk.lispx"
+bench "read them, 100 x (== a b)" "$TMP/walk.lispx" "$TOP/bench/walk.lispx"
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Build lispx as it was at git revision REV into directory OUT, with
+# the stdlib.lispx of that revision, for bench/run.sh to time against:
+#
+#     sh bench/build-rev.sh HEAD~10 /tmp/base
+#     make bench BASELINE=/tmp/base
+#
+# Revisions before the single-pass reader build against the mpc
+# submodule; set MPC to a checkout of https://github.com/orangeduck/mpc.
+# Older revisions crashed when readline returned NULL at the end of
+# input, so they are patched to end the REPL there as lispx now does.
+
+REV=$1
+OUT=$2
+if [ -z "$REV" ] || [ -z "$OUT" ]; then
+    echo "usage: sh bench/build-rev.sh REV OUT" >&2
+    exit 2
+fi
+
+src=$(mktemp -d) || exit 1
+trap 'rm -rf "$src"' EXIT
+git archive "$REV" | tar -x -C "$src" || exit 1
+if [ -n "$MPC" ]; then
+    rmdir "$src/mpc" 2> /dev/null
+    ln -s "$MPC" "$src/mpc"
+fi
+
+eof='s/^\( *\)char \*input = readline("lispx>");$/&\n\1if (!input) {break;}/'
+grep -q 'if (!input)' "$src/lispx.c" || sed -i "$eof" "$src/lispx.c"
+
+make -C "$src" > /dev/null || exit 1
+mkdir -p "$OUT"
+cp "$src/lispx" "$src/stdlib.lispx" "$OUT/"
@@ -0,0 +1,77 @@
+# Helpers for the bench/bench-*.sh scripts, which bench/run.sh runs
+# with LISPX, TOP and TMP set.
+
+BENCH_RUNS=${BENCH_RUNS:-3}
+
+# run $2 on $TMP/run.lispx from directory $1, output to $TMP/bench.out;
+# the subshell waits for it, so that a crash is reported to /dev/null
+bench_exec() {
+    rm -f "$TMP/bench.out"
+    (cd "$1" && "$2" "$TMP/run.lispx" < /dev/null \
+         > "$TMP/bench.out" 2>&1; :) 2> /dev/null
+}
+
+# best wall-clock seconds of BENCH_RUNS runs of lispx from directory
+# $1 (the binary is $1/lispx unless it is the one under test) loading
+# the files $2..., or "-" if a run fails or reports an error. The files
+# are joined into one, since older builds loaded only their first
+# argument.
+bench_time() {
+    dir=$1
+    bin=$dir/lispx
+    [ "$dir" = "$TOP" ] && bin=$LISPX
+    shift
+    cat "$@" > "$TMP/run.lispx"
+    echo '(print "bench-done")' >> "$TMP/run.lispx"
+
+    i=0
+    best=
+    while [ $i -lt "$BENCH_RUNS" ]; do
+        start=$(date +%s%N)
+        bench_exec "$dir" "$bin"
+        end=$(date +%s%N)
+        if ! grep -q bench-done "$TMP/bench.out" ||
+           grep -q "^Error" "$TMP/bench.out"; then
+            echo "-"
+            return
+        fi
+        t=$((end - start))
+        if [ -z "$best" ] || [ $t -lt $best ]; then best=$t; fi
+        i=$((i + 1))
+    done
+    awk -v t="$best" 'BEGIN {printf "%.3f\n", t / 1e9}'
+}
+
+# time the files $2... under the label $1, with the baseline too if set
+bench() {
+    label=$1
+    shift
+    base=
+    [ -n "$BASELINE" ] && base=$(bench_time "$BASELINE" "$@")
+    printf '%-46s %9s %9s\n' "$label" "$(bench_time "$TOP" "$@")" "$base"
+}
+
+# the value of (gc-stats {$2}) once lispx from directory $1 has loaded
+# the files $3..., or "-" if the run fails or lacks the statistic
+bench_count() {
+    dir=$1
+    bin=$dir/lispx
+    [ "$dir" = "$TOP" ] && bin=$LISPX
+    stat=$2
+    shift 2
+    cat "$@" > "$TMP/run.lispx"
+    echo "(print \"bench-stat\" (gc-stats {$stat}))" >> "$TMP/run.lispx"
+
+    bench_exec "$dir" "$bin"
+    n=$(sed -n 's/^"bench-stat" {\([0-9]*\)}.*/\1/p' "$TMP/bench.out")
+    echo "${n:--}"
+}
+
+# print statistic $2 after loading the files $3... under the label $1
+bench_stat() {
+    label=$1
+    shift
+    base=
+    [ -n "$BASELINE" ] && base=$(bench_count "$BASELINE" "$@")
+    printf '%-46s %9s %9s\n' "$label" "$(bench_count "$TOP" "$@")" "$base"
+}
@@ -0,0 +1,39 @@
+#!/bin/sh
+# Run every bench/bench-*.sh, or just the ones named, against one lispx
+# binary from the top of the tree. Each case prints the best wall-clock
+# time of BENCH_RUNS runs (3 by default).
+#
+# With BASELINE set to a directory holding another build, as made by
+# bench/build-rev.sh, each case is also timed with that build, run from
+# its own directory so that it loads its own stdlib.lispx. A case that
+# fails, or that the baseline does not support, shows "-".
+#
+# usage: sh bench/run.sh [lispx] [name ...]
+
+LISPX=${1:-./lispx}
+case $LISPX in
+    /*) ;;
+    *) LISPX=$PWD/$LISPX ;;
+esac
+[ $# -gt 0 ] && shift
+
+cd "$(dirname "$0")/.." || exit 1
+TOP=$PWD
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+export LISPX TOP TMP
+
+if [ $# -eq 0 ]; then
+    set -- bench/bench-*.sh
+else
+    for name in "$@"; do
+        shift
+        set -- "$@" "bench/bench-$name.sh"
+    done
+fi
+
+printf '%-46s %9s %9s\n' "" "lispx" "${BASELINE:+baseline}"
+for b in "$@"; do
+    echo "== $b"
+    sh "$b"
+done
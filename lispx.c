@@ -1,20 +1,21 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
-
-#include "mpc/mpc.h"
-
-mpc_parser_t *Number;
-mpc_parser_t *Symbol;
-mpc_parser_t *String;
-mpc_parser_t *Comment;
-mpc_parser_t *Sexpr;
-mpc_parser_t *Qexpr;
-mpc_parser_t *Expr;
-mpc_parser_t *Lispx;
-
-#ifdef _WIN32
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 
+#ifdef _WIN32
 char *readline(char *prompt) {
     static char buffer[2048];
 
@@ -32,24 +33,12 @@ void add_history(char *unused) {}
 
 #include <editline/readline.h>
 #include <editline/history.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #endif
 
-int number_of_nodes(mpc_ast_t *t) {
-    if (t->children_num == 0) {return 1;}
-
-    if (t->children_num >= 1) {
-        int total = 1;
-
-        for (int i = 0; i < t->children_num; i++){
-            total += number_of_nodes(t->children[i]);
-        }
-        return total;
-    }
-
-    return -1;
-}
-
 /* forward declartions */
 
 struct lval;
@@ -60,95 +49,634 @@ typedef struct lenv lenv;
 
 /* lisp value */
 enum {LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_STR,
-      LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR,};
+      LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_DBL, LVAL_BIG, LVAL_BUILDER,};
 enum {LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM,};
 
+/* operators of the arithmetic and comparison builtins, named in
+   lnum_names */
+enum {LNUM_ADD, LNUM_SUB, LNUM_MUL, LNUM_DIV,
+      LNUM_GT, LNUM_LT, LNUM_GE, LNUM_LE, LNUM_EQ, LNUM_NE,};
+char *lnum_names[] = {"+", "-", "*", "/", ">", "<", ">=", "<=", "==", "!="};
+
 typedef lval* (*lbuiltin)(lenv*, lval*);
 
+/* Every lval and lenv starts with this header, which links it into the
+   collector's list of all objects. */
+typedef struct lobj lobj;
+
+enum {LOBJ_VAL, LOBJ_ENV,};
+
+struct lobj {
+    lobj *gc_prev;
+    lobj *gc_next;
+    unsigned char kind;
+    unsigned char mark;
+};
+
+/* Nested lists are freed, marked, compared, printed and evaluated with
+   stacks on the heap rather than by recursion, so how deep values nest
+   is bounded by memory instead of the C stack. An entry is a value and
+   the index of the next of its items to visit. */
+typedef struct {
+    lval *v;
+    int i;
+} lwalk;
+
+typedef struct {
+    int count;
+    int cap;
+    lwalk *items;
+} lstack;
+
+/* Bytes of a file being loaded read between letting the pages read so
+   far go, see builtin_load */
+#ifndef LFILE_DROP_STEP
+#define LFILE_DROP_STEP (16L << 20)
+#endif
+
+/* Files imported or loaded from the command line, by resolved path.
+   Each is imported once, from a cache of its forms already read when
+   it has one, see lmod_load. */
+struct {
+    int count;
+    int cap;
+    char **paths;
+} lmods;
+
+#define LMOD_MAGIC "lispx forms\n"
+
+/* Source text being read, see lread_form */
+typedef struct {
+    char *p;
+    char *end;
+    int line;
+    lstack open;/* enclosing lists, with the line the next one starts on */
+    int cap;
+    char *buf;/* scratch for the text of a string or symbol */
+} lreader;
+
+/* Bytes of lval/lenv allocation between two collections */
+#ifndef LGC_HEAP_STEP
+#define LGC_HEAP_STEP (4L << 20)
+#endif
+
+/* Garbage collector. Reference counts release most values as soon as
+   they die, the mark and sweep collector reclaims whatever they miss.
+   It only runs at safe points at the top level (between REPL lines and
+   between the forms of a file loaded from the command line), where the
+   global environment and the root stack are all that is live. */
+struct {
+    lobj objs;/* sentinel of the list of all objects */
+    lenv *env;
+    int nroots;
+    int maxroots;
+    lval **roots;
+    int safe;/* set while builtin_load may collect between forms */
+    lstack gray;/* marked values whose items are not marked yet */
+
+    long objects;
+    long allocated;/* bytes allocated since the last collection */
+    long collections;
+    long freed;
+    long live_bytes;
+    long last_pause;/* in microseconds */
+    long max_pause;
+    long total_pause;
+} lgc;
+
+/* Symbol names are interned: each distinct name is stored once in
+   'lsyms' and never freed, so symbols compare and hash by pointer. */
+struct {
+    int count;
+    int cap;
+    char **names;
+} lsyms;
+
+/* Each name is stored after a header of per symbol state, LSYM gives
+   the header of an interned name. */
+typedef struct {
+    long shadows;/* bindings of the symbol in environments other than
+                    the global one, see lenv_get */
+    char name[];
+} lsym;
+
+#define LSYM(s) ((lsym *)((s) - offsetof(lsym, name)))
+
+char *lsym_amp;/* the interned "&" used by variadic formals */
+char *lsym_if;/* the interned names of the forms lcode_list compiles */
+char *lsym_do;
+char *lsym_let;
+
+/* Numbers that fit in a pointer with one bit to spare are stored in the
+   lval pointer itself, tagged with the low bit, and never allocated.
+   Only numbers outside that range are boxed as heap LVAL_NUM values.
+   Use lval_type and lval_to_num on anything that may be a number. */
+#define LVAL_FIXNUM_MIN (INTPTR_MIN >> 1)
+#define LVAL_FIXNUM_MAX (INTPTR_MAX >> 1)
+#define LVAL_IS_FIXNUM(v) ((uintptr_t)(v) & 1)
+
+/* On 64 bit hosts doubles are stored in the pointer as well, tagged 2 in
+   the low two bits, when their exponent is in the middle of its range
+   (magnitudes between about 1e-77 and 1e77) or they are +0.0: the bits
+   are rotated left by three, which moves the three high exponent bits,
+   of which only the first is needed, down to where the tag goes. Other
+   doubles are boxed as heap LVAL_DBL values. This is the scheme of
+   CRuby's flonums. Use lval_to_dbl on anything that may be a double. */
+#define LVAL_IS_FLONUM(v) (((uintptr_t)(v) & 3) == 2)
+#define LVAL_FLONUM_ZERO ((uintptr_t)0x8000000000000002)
+
+/* values that are not allocated, fixnums or flonums */
+#define LVAL_IS_IMM(v) ((uintptr_t)(v) & 3)
+
+/* strings this long and longer are allocated separately from their lval,
+   see lval_strn. 16 keeps the string fields no larger than a list's. */
+#ifndef LSTR_SMALL
+#define LSTR_SMALL 16
+#endif
+
+/* Frames with at most LENV_SMALL bindings keep syms/vals as dense
+   arrays and are scanned linearly; larger frames switch to an open
+   addressing hash table of 'cap' slots (empty slots have a NULL sym). */
+#define LENV_SMALL 8
+
 struct lenv {
+    lobj gc;
     lenv *par;
     int count;
+    int cap;
     char **syms;
     lval **vals;
 };
 
+/* The fields of each type overlap, so a value is a single 64 byte
+   cache line whatever its type. Only touch the fields of v->type. */
 struct lval{
+    lobj gc;
     int type;
+    int refs;/* number of owners, see lval_ref and lval_own */
+
+    union {
+        /* Basic */
+        long num;
+        double dbl;
+        char *err;/* Error and Symbol types have some string data */
+        char *sym;/* interned, see lsym_intern */
+
+        /* String, and string builder: 'slen' bytes at 'str', which are
+           followed by a NUL but may hold NULs too. Strings shorter
+           than LSTR_SMALL are kept in 'small', inside the lval itself;
+           a builder has room for 'scap' bytes at 'str' instead. */
+        struct {
+            long slen;
+            char *str;
+            union {
+                char small[LSTR_SMALL];
+                long scap;
+            };
+        };
+
+        /* Integer too big for a long, see lbig_norm */
+        struct {
+            int bneg;/* 1 if negative */
+            int blen;
+            uint32_t *big;/* base 2^32 digits, least significant first */
+        };
+
+        /* Function */
+        struct {
+            lbuiltin builtin;
+            lenv *env;
+            lval *formals;
+            lval *body;
+        };
+
+        /* Expression */
+        struct {
+            int count;/* count and point to a list of "lval*" */
+            int cap;/* room in 'cell', see lval_reserve */
+            lval **cell;
+            lval *base;/* see lval_slice */
+            struct lcode *code;/* see lvm_code */
+        };
+    };
+};
 
-    /* Basic */
-    long num;
-    char *err;/* Error and Symbol types have some string data */
-    char *sym;
-    char *str;
+/* the slab pools align values to the line, and strings, bignums and
+   lists are laid out to stay within it */
+_Static_assert(sizeof(lval) <= 64, "an lval must fit in a cache line");
 
-    /* Function */
-    lbuiltin builtin;
-    lenv *env;
-    lval *formals;
-    lval *body;
+/* Bytecode. The body of a lambda is compiled the first time it runs
+   and the result is cached on the body list (see lvm_code). 'ops' holds
+   each opcode followed by its operands, 'consts' the values they refer
+   to, each of which holds a reference. */
+typedef struct lcode lcode;
+
+struct lcode {
+    int count;
+    int cap;
+    int *ops;
+    int nconsts;
+    int maxconsts;
+    lval **consts;
+    int ncaches;
+    struct lcache *caches;/* one per LOP_LOAD, see lvm_run */
+    lval *fn;/* while compiling, see lcode_slot */
+    int scopes;/* while compiling, number of enclosing 'let's */
+    int depth;/* while compiling, nesting of lcode_list */
+};
+
+/* Lists nested deeper than this in a body are not compiled but left to
+   the tree walker (LOP_EVAL), since the compiler recurses */
+#define LCODE_MAX_DEPTH 256
+
+/* Inline cache of a LOP_LOAD: the global slot its symbol was found in
+   while the global environment was at 'version' */
+typedef struct lcache {
+    long version;
+    int slot;
+} lcache;
+
+/* Every change to the global environment bumps 'version', which
+   invalidates all inline caches at once */
+struct {
+    long version;
+    long hits;
+    long misses;
+} lic = {1};
+
+enum {
+    LOP_CONST,/* k: push consts[k] */
+    LOP_LOAD,/* k ic: push the value of the symbol consts[k] */
+    LOP_LOCAL,/* k slot: LOP_LOAD of a formal, expected at 'slot' */
+    LOP_APPLY,/* n: pop n values and evaluate them as an S-Expression */
+    LOP_TAILAPPLY,/* n: LOP_APPLY in tail position, see lvm_run */
+    LOP_IF,/* t f else end: branch on an inline 'if', see lcode_list */
+    LOP_DO,/* n: LOP_APPLY of an inline 'do' */
+    LOP_LET,/* k end: open the scope of an inline 'let' */
+    LOP_ENDLET,
+    LOP_EVAL,/* k: push consts[k] evaluated by the tree walker */
+    LOP_JUMP,/* pc */
+    LOP_RET,
+};
+
+/* The virtual machine runs lambda bodies without recursing on the C
+   stack: calling a lambda pushes a frame, returning pops it. Builtins
+   that evaluate (eval, load, ...) still go through lval_eval, which
+   re-enters the machine on top of the frames already there. Set
+   'enabled' to 0 (--tree-walk) to run bodies with lval_eval instead. */
+typedef struct {
+    lval *fn;/* the function running, holding on to its body */
+    lenv *env;/* its activation frame, owned by the frame */
+    lcode *code;
+    int pc;
+} lframe;
+
+struct {
+    int enabled;
+    int sp;
+    int maxsp;
+    lval **stack;
+    int fp;
+    int maxfp;
+    lframe *frames;
+} lvm = {1};
+
+/* Evaluation gives an error rather than nest deeper than LMAX_DEPTH
+   S-Expressions (or lambda calls in the machine). At most LMAX_NEST of
+   those levels may be evaluations started from C, which do use the C
+   stack: lambda calls in the tree walker, and builtins like eval and
+   map calling back into the evaluator. A level through map costs about
+   550 bytes of C stack unoptimised, so the default stays within an 8MB
+   stack. */
+#ifndef LMAX_DEPTH
+#define LMAX_DEPTH (1L << 21)
+#endif
+
+#ifndef LMAX_NEST
+#define LMAX_NEST 10000
+#endif
+
+/* An S-Expression the tree walker is in the middle of: 'args' holds
+   the values of the first 'i' items of 'code' */
+typedef struct {
+    lval *code;
+    int i;
+    lval *args;
+} lsexpr;
 
-    /* Expression */
-    int count;/* count and point to a list of "lval*" */
-    lval **cell;
+struct {
+    int count;
+    int cap;
+    lsexpr *sexprs;
+    int nest;/* evaluations started from C, see lval_eval_sexpr */
+} leval;
+
+/* Values whose last reference goes while lval_del is freeing another
+   one wait here, instead of being freed recursively */
+struct {
+    lstack pending;
+    int busy;
+} ldel;
+
+/* Every builtin added by lenv_add_builtin, in order. Images refer to
+   builtins by their index here. */
+struct {
+    int count;
+    int cap;
+    char **names;
+    lbuiltin *funcs;
+} lbuiltins;
+
+/* Heap images. An image holds the global environment as it was after
+   loading a source file, and the modules the file imported, so that a
+   later run can restore them instead of reading and evaluating the file
+   again (see limg_load). Values are
+   written depth first, each as a tag byte and its data, lists and
+   lambdas followed by their items. A value with several owners is
+   written once with LIMG_SHARED set, and after that as a LIMG_REF to
+   the order it was first written in, so sharing survives the round
+   trip. Symbols are shared the same way, one per name. Builtins are
+   written as their index in lbuiltins. Bytecode is not kept, it is
+   compiled again on the first call. */
+#define LIMG_MAGIC "lispx image\n"
+#define LIMG_VERSION 3
+
+enum {LIMG_NUM, LIMG_ERR, LIMG_SYM, LIMG_STR, LIMG_BUILTIN,
+      LIMG_LAMBDA, LIMG_SEXPR, LIMG_QEXPR, LIMG_REF, LIMG_DBL, LIMG_BIG,
+      LIMG_BUILDER,};
+
+#define LIMG_SHARED 0x80
+
+/* an image being written */
+typedef struct {
+    long len;
+    long cap;
+    char *data;
+    long count;/* values written with LIMG_SHARED */
+    long slots;/* the shared values written so far, */
+    void **vals;/* hashed by address, and their order */
+    long *ids;
+} limg_buf;
+
+/* an image being read, and the list of the shared values read so far,
+   which holds a number in place of a value still being read */
+typedef struct {
+    char *p;
+    char *end;
+    lval *shared;
+} limg_in;
+
+/* a list or lambda being read: the items read so far and how many are
+   left. Lambdas are read as the list of their bound symbols, formals,
+   body and bound values. */
+typedef struct {
+    lval *v;
+    long left;
+    int tag;
+    long id;/* its index in 'shared', or -1 */
+} limg_list;
+
+/* Allocator. lvals, lenvs and arrays of pointers (list cells and
+   environment tables) of up to 1 << (LCELL_CLASSES-1) slots come from
+   pools: each pool carves fixed size blocks out of LSLAB_SIZE slabs
+   (aligned to LSLAB_ALIGN so blocks do not straddle cache lines) and
+   keeps freed blocks on a free list for reuse. Build with
+   -DLALLOC_MALLOC to use plain malloc/free instead (e.g. for ASan). */
+#define LSLAB_SIZE (64 * 1024)
+#define LSLAB_ALIGN 64
+#define LCELL_CLASSES 7
+
+typedef struct lpool lpool;
+
+struct lpool {
+    int size;
+    void *free;
+    char *bump;
+    char *end;
+
+    long allocs;
+    long hits;/* allocations served from the free list */
+    long slabs;
 };
 
+enum {LPOOL_VAL, LPOOL_ENV, LPOOL_CELLS,};
+
+struct {
+    lpool pools[LPOOL_CELLS + LCELL_CLASSES];
+    long large;/* cell arrays too big for any pool */
+} lalloc = {{
+    {sizeof(lval)}, {sizeof(lenv)},
+    {sizeof(void *) * 1}, {sizeof(void *) * 2}, {sizeof(void *) * 4},
+    {sizeof(void *) * 8}, {sizeof(void *) * 16}, {sizeof(void *) * 32},
+    {sizeof(void *) * 64},
+}};
+
 lval *lval_num(long x);
+long lval_to_num(lval *v);
+lval *lval_dbl(double x);
+double lval_to_dbl(lval *v);
+int lval_type(lval *v);
 lval *lval_err(char *fmt, ...);
 lval *lval_sym(char *m);
+char *lsym_intern(char *name);
 lval *lval_str(char *s);
+lval *lval_strn(char *s, long n);
+lval *lval_builder(void);
+void lstr_add(lval *b, char *s, long n);
 lval *lval_sexpr(void);
 lval *lval_qexpr(void);
 lval *lval_lambda(lval *formals, lval *body);
 lval *lval_fun(lbuiltin func);
-lval *lval_read_num(mpc_ast_t *t);
-lval *lval_read_str(mpc_ast_t *t);
 lval *lval_add(lval *v, lval *x);
-lval *lval_read(mpc_ast_t *t);
+lval *lval_read(char *s);
+lval *lread_form(lreader *r);
+void lread_reserve(lreader *r, int n);
+void lread_free(lreader *r);
+int lread_symchar(int c);
+char *lread_digits(char *p, char *end);
 lval *lval_pop(lval *v, int i);
 lval *lval_take(lval *v, int i);
 lval *lval_copy(lval *v);
+lval *lval_ref(lval *v);
+lval *lval_own(lval *v);
+lval *lval_slice(lval *v, int start, int end);
+void lval_reserve(lval *v, int n);
+void lval_unview(lval *v);
+lval *lval_alloc(void);
+void lval_free(lval *v);
+lenv *lenv_alloc(void);
+void lenv_free(lenv *e);
+void *lpool_alloc(lpool *p);
+void lpool_free(lpool *p, void *b);
+int lcells_class(int n);
+void *lcells_alloc(int n);
+void *lcells_realloc(void *c, int n, int m);
+void lcells_free(void *c, int n);
+void lgc_init(void);
+void lgc_link(lobj *o, int kind, long size);
+void lgc_unlink(lobj *o);
+void lgc_root(lval *v);
+void lgc_unroot(void);
+void lgc_mark_val(lval *v);
+void lgc_mark_env(lenv *e);
+void lgc_trace(void);
+void lstack_push(lstack *s, lval *v, int i);
+void lgc_collect(void);
+void lgc_safepoint(void);
+lval *builtin_gc_stats(lenv *e, lval *a);
 lval *lval_call(lenv *e, lval *f, lval *a);
+lval *lval_bind(lenv *e, lval *f, lval *a, lenv **frame);
+lcode *lcode_compile(lval *f);
+int lcode_slot(lcode *c, char *sym);
+void lcode_expr(lcode *c, lval *x, int tail);
+void lcode_list(lcode *c, lval *x, int tail);
+void lcode_form(lcode *c, lval *x, int tail);
+void lcode_emit(lcode *c, int op);
+int lcode_const(lcode *c, lval *v);
+void lcode_del(lcode *c, int release);
+void lgc_mark_code(lcode *c);
+lcode *lvm_code(lval *f);
+void lvm_forget(lval *v);
+void lvm_push(lval *v);
+void lvm_enter(lval *f, lenv *env);
+lval *lvm_apply(lenv *e, int n, lenv **frame);
+lval *lvm_run(lval *f, lenv *env);
 lval *builtin_head(lenv *e, lval *a);
 lval *builtin_tail(lenv *e, lval *a);
 lval *builtin_list(lenv *e, lval *a);
 lval *builtin_len(lenv *e, lval *a);
+lval *lval_apply(lenv *e, lval *f, lval *x, lval *y);
+lval *builtin_nth(lenv *e, lval *a);
+lval *builtin_last(lenv *e, lval *a);
+lval *builtin_init(lenv *e, lval *a);
+lval *builtin_take(lenv *e, lval *a);
+lval *builtin_drop(lenv *e, lval *a);
+lval *builtin_reverse(lenv *e, lval *a);
+lval *builtin_elem(lenv *e, lval *a);
+lval *builtin_map(lenv *e, lval *a);
+lval *builtin_filter(lenv *e, lval *a);
+lval *builtin_foldl(lenv *e, lval *a);
+lval *builtin_foldr(lenv *e, lval *a);
+lval *builtin_zip(lenv *e, lval *a);
+lval *builtin_unzip(lenv *e, lval *a);
 lval *builtin_eval(lenv *e, lval *a);
 lval *builtin_join(lenv *e, lval *a);
 lval *builtin_add(lenv *e,lval *a);
 lval *builtin_sub(lenv *e,lval *a);
 lval *builtin_mul(lenv *e,lval *a);
 lval *builtin_div(lenv *e,lval *a);
-lval *builtin_op(lenv *e, lval *a, char *op);
+lval *builtin_op(lenv *e, lval *a, int op);
+int lnum_op(lbuiltin f);
+lval *lnum_binop(int op, long x, long y);
+lval *lnum_dblop(int op, double x, double y);
+lval *lnum_arith(int op, lval *x, lval *y);
+int lnum_is(lval *v);
+double lnum_to_dbl(lval *v);
+lval *lbig_new(int len);
+lval *lbig_norm(lval *v);
+lval *lbig_of(lval *v);
+int lbig_cmpmag(lval *x, lval *y);
+int lbig_cmp(lval *x, lval *y);
+lval *lbig_addmag(lval *x, lval *y, int neg);
+lval *lbig_submag(lval *x, lval *y, int neg);
+lval *lbig_add(lval *x, lval *y, int yneg);
+lval *lbig_mul(lval *x, lval *y);
+lval *lbig_div(lval *x, lval *y);
+lval *lbig_binop(int op, lval *x, lval *y);
+double lbig_to_dbl(lval *v);
+lval *lbig_read(char *s, char *end, int neg);
+void lbig_print(lval *v);
 lval *builtin_def(lenv *e, lval *a);
 lval *builtin_put(lenv *e, lval *a);
 lval *builtin_var(lenv *e, lval *a, char *func);
 lval *builtin_lambda(lenv *e, lval *a);
-lval *builtin_ord(lenv *e, lval *a, char *op);
+lval *builtin_ord(lenv *e, lval *a, int op);
 lval *builtin_gt(lenv *e, lval *a);
 lval *builtin_lt(lenv *e, lval *a);
 lval *builtin_ge(lenv *e, lval *a);
 lval *builtin_le(lenv *e, lval *a);
-lval *builtin_cmp(lenv *e, lval *a, char *op);
+lval *builtin_cmp(lenv *e, lval *a, int op);
 lval *builtin_eq(lenv *e, lval *a);
 lval *builtin_ne(lenv *e, lval *a);
 lval *builtin_if(lenv *e, lval *a);
+lval *builtin_do(lenv *e, lval *a);
+lval *builtin_let(lenv *e, lval *a);
+lval *builtin_fun(lenv *e, lval *a);
+lval *builtin_select(lenv *e, lval *a);
+lval *builtin_case(lenv *e, lval *a);
 lval *builtin_load(lenv *e, lval *a);
+void lload_form(lenv *e, lval *x, int safe);
+lval *builtin_import(lenv *e, lval *a);
+char *lmod_resolve(char *name);
+int lmod_add(char *path);
+void lmod_remove(char *path);
+long lfile_mtime(struct stat *st);
+lval *lmod_load(lenv *e, char *path);
 lval *builtin_print(lenv *e, lval *a);
 lval *builtin_error(lenv *e, lval *a);
+lval *builtin_str_len(lenv *e, lval *a);
+lval *builtin_substr(lenv *e, lval *a);
+lval *builtin_str_concat(lenv *e, lval *a);
+lval *builtin_str_join(lenv *e, lval *a);
+lval *builtin_str_split(lenv *e, lval *a);
+lval *builtin_str_builder(lenv *e, lval *a);
+lval *builtin_str_add(lenv *e, lval *a);
+lval *builtin_str_build(lenv *e, lval *a);
+long lalloc_hit_pct(int first, int last);
+long lgc_stat(char *name);
 lval *builtin(lenv *e, lval *a, char *func);
 lval *lval_join(lval *x, lval *y);
 lval *lval_eval_sexpr(lenv *e, lval *v);
+lval *lval_eval_apply(lenv *e, lval *v);
 lval *lval_eval(lenv *e, lval *v);
+char *lfile_map(char *name, long *size);
+void lfile_unmap(char *p, long size);
+long lfile_drop(char *p, long n);
+unsigned long limg_sum(char *p, long n);
+unsigned long limg_builtins(void);
+void limg_put(limg_buf *b, void *p, long n);
+void limg_put_long(limg_buf *b, long x);
+void limg_put_str(limg_buf *b, char *s);
+void limg_put_mem(limg_buf *b, char *s, long n);
+long limg_shared(limg_buf *b, void *key);
+void limg_put_sym(limg_buf *b, char *sym);
+lval *limg_item(lval *v, int *i);
+void limg_put_val(limg_buf *b, lval *v);
+int limg_dump(lenv *e, char *image, char *src, long size,
+              unsigned long sum, int mods);
+int limg_write(char *name, char *magic, limg_buf *b);
+void limg_buf_free(limg_buf *b);
+int limg_open(limg_in *r, char *magic);
+void limg_in_free(limg_in *r);
+char *limg_get(limg_in *r, long n);
+int limg_get_long(limg_in *r, long *x);
+void limg_keep(limg_in *r, lval *v);
+lval *limg_ref(limg_in *r, long n);
+char *limg_get_str(limg_in *r);
+char *limg_get_mem(limg_in *r, long *n);
+lval *limg_get_sym(limg_in *r);
+lval *limg_finish(limg_list *l);
+lval *limg_get_val(limg_in *r);
+int limg_restore(lenv *e, char *image, char *src, long size,
+                 unsigned long sum);
+lval *limg_load(lenv *e, char *image, char *src);
 void lenv_add_builtin(lenv *e, char *name, lbuiltin func);
 void lenv_add_builtins(lenv *e);
 void lval_del(struct lval *v);
-void lval_expr_print(lval *v, char open, char close);
+void lval_release(lval *v, int release);
+void lval_print_dbl(double x);
 void lval_print(struct lval *v);
 void lval_println(struct lval *v);
 char *ltype_name(int t);
 int  lval_eq(lval *x, lval *y);
 lenv *lenv_new(void);
 void lenv_del(lenv *e);
+void lenv_release(lenv *e, int release);
+unsigned long lsym_hash(char *s);
+unsigned long lenv_hash(char *sym);
+int lenv_slot(lenv *e, char *sym);
+int lenv_shadows(lenv *e, lenv *f);
+void lenv_grow(lenv *e);
 lval *lenv_get(lenv *e, lval *k);
 lenv *lenv_copy(lenv *e);
 void lenv_put(lenv *e, lval *k, lval *v);
@@ -161,11 +689,17 @@ void lenv_def(lenv *e, lval *k, lval *v);
         return err;									\
     }
 #define LASSERT_TYPE(func, args, index, expect)						\
-    LASSERT(args, args->cell[index]->type == expect,				\
+    LASSERT(args, lval_type(args->cell[index]) == expect,			\
             "Function '%s' passed incorrect type for argument %i. "	\
             "Got %s, Expected %s.",									\
-            func, index, ltype_name(args->cell[index]->type),		\
+            func, index, ltype_name(lval_type(args->cell[index])),	\
             ltype_name(expect))
+#define LASSERT_IS_NUM(func, args, index)							\
+    LASSERT(args, lnum_is(args->cell[index]),						\
+            "Function '%s' passed incorrect type for argument %i. "	\
+            "Got %s, Expected %s.",									\
+            func, index, ltype_name(lval_type(args->cell[index])),	\
+            ltype_name(LVAL_NUM))
 #define LASSERT_NUM(func, args, num)								\
     LASSERT(args, args->count == num,								\
             "Function '%s', passed incorrect number of argumen. "	\
@@ -181,9 +715,12 @@ char *ltype_name(int t) {
     switch(t) {
     case LVAL_FUN: return "Function";
     case LVAL_NUM: return "Number";
+    case LVAL_DBL: return "Double";
+    case LVAL_BIG: return "Bignum";
     case LVAL_ERR: return "Error";
     case LVAL_SYM: return "Symbol";
     case LVAL_STR: return "String";
+    case LVAL_BUILDER: return "Builder";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
     default: return "Unknown";
@@ -191,45 +728,66 @@ char *ltype_name(int t) {
 }
 
 int  lval_eq(lval *x, lval *y) {
-    /* Different Types are always unequal */
-    if (x->type != y->type) {return 0;}
-
-    /* Compare Based upon type */
-    switch(x->type) {
-        /*Compare Number Value*/
-    case LVAL_NUM: return (x->num == y->num);
-        /*Compare String Value*/
-    case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-    case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-    case LVAL_STR: return (strcmp(x->str, y->str) == 0);
-        /*If builtin Compare, otherwise Compare formals and body*/
-    case LVAL_FUN:
-        if (x->builtin || y->builtin) {
-            return x->builtin == y->builtin;
-        } else {
-            return lval_eq(x->formals, y->formals)
-                && lval_eq(x->body, y->body);
-        }
-        /*If list Compare every individual element*/
-    case LVAL_QEXPR:
-    case LVAL_SEXPR:
-        if (x->count != y->count) {return 0;}
-        for (int i = 0; i < x->count; i++) {
-            /*if any element not equal then whole list not equal*/
-            if (!lval_eq(x->cell[i], y->cell[i])) {return 0;}
+    /* pairs of items still to compare, pushed x first */
+    static lstack pairs;
+    int eq = 1;
+
+    for (;;) {
+        /* Different Types are always unequal, but numbers of different
+           kinds are compared by value */
+        if (lval_type(x) != lval_type(y)) {
+            eq = lnum_is(x) && lnum_is(y)
+                && lval_to_num(lnum_arith(LNUM_EQ, x, y));
+            if (!eq) {break;}
+        } else switch(lval_type(x)) {
+            /*Compare Number Value*/
+        case LVAL_NUM: eq = (lval_to_num(x) == lval_to_num(y)); break;
+        case LVAL_DBL: eq = (lval_to_dbl(x) == lval_to_dbl(y)); break;
+        case LVAL_BIG: eq = (lbig_cmp(x, y) == 0); break;
+            /*Compare String Value*/
+        case LVAL_ERR: eq = (strcmp(x->err, y->err) == 0); break;
+        case LVAL_SYM: eq = (x->sym == y->sym); break;
+        case LVAL_STR:
+            eq = x->slen == y->slen && memcmp(x->str, y->str, x->slen) == 0;
+            break;
+        case LVAL_BUILDER: eq = x == y; break;
+            /*If builtin Compare, otherwise Compare formals and body*/
+        case LVAL_FUN:
+            if (x->builtin || y->builtin) {
+                eq = x->builtin == y->builtin;
+            } else {
+                lstack_push(&pairs, x->formals, 0);
+                lstack_push(&pairs, y->formals, 0);
+                lstack_push(&pairs, x->body, 0);
+                lstack_push(&pairs, y->body, 0);
+            }
+            break;
+            /*If list Compare every individual element*/
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            if (x->count != y->count) {eq = 0; break;}
+            for (int i = x->count - 1; i >= 0; i--) {
+                lstack_push(&pairs, x->cell[i], 0);
+                lstack_push(&pairs, y->cell[i], 0);
+            }
+            break;
         }
-        /*otherwise lists must be equal*/
-        return 1;
-        break;
+
+        /*if any element not equal then whole list not equal*/
+        if (!eq || pairs.count == 0) {break;}
+        y = pairs.items[--pairs.count].v;
+        x = pairs.items[--pairs.count].v;
     }
 
-    return 0;
+    pairs.count = 0;
+    return eq;
 }
 
 lenv *lenv_new(void) {
-    lenv *e = malloc(sizeof(lenv));
+    lenv *e = lenv_alloc();
     e->par = NULL;
     e->count = 0;
+    e->cap = 0;
     e->syms = NULL;
     e->vals = NULL;
 
@@ -237,74 +795,228 @@ lenv *lenv_new(void) {
 }
 
 void lenv_del(lenv *e) {
-    for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
+    lenv_release(e, 1);
+}
+
+/* free e; with release set the values bound in it are released too,
+   otherwise it is garbage found by the collector */
+void lenv_release(lenv *e, int release) {
+    /* hashed frames have 'cap' slots, some of them empty */
+    int n = e->cap ? e->cap : e->count;
+    for (int i = 0; i < n; i++) {
+        if (!e->syms[i]) {continue;}
+        if (release) {lval_del(e->vals[i]);}
+        LSYM(e->syms[i])->shadows--;
     }
 
-    free(e->syms);
-    free(e->vals);
+    lcells_free(e->syms, n);
+    lcells_free(e->vals, n);
 
-    free(e);
+    lenv_free(e);
 }
 
-lval *lenv_get(lenv *e, lval *k) {
-    /* iterate over all items in environment */
-    for (int i = 0; i < e->count; i++) {
-        /* check if the stored string matches the symbol string
-           if it does, return a copy of the value */
-        if (strcmp(e->syms[i], k->sym) == 0){
-            return lval_copy(e->vals[i]);
+/* FNV-1a hash of a symbol name */
+unsigned long lsym_hash(char *s) {
+    unsigned long h = 2166136261UL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619UL;
+    }
+
+    return h;
+}
+
+/* return the unique copy of 'name', adding it to the table if needed */
+char *lsym_intern(char *name) {
+    unsigned long mask = lsyms.cap - 1;
+    if (lsyms.cap) {
+        unsigned long i = lsym_hash(name) & mask;
+        while (lsyms.names[i]) {
+            if (strcmp(lsyms.names[i], name) == 0) {return lsyms.names[i];}
+            i = (i + 1) & mask;
         }
     }
 
-    /* if no symbol check in parent otherwise error */
-    if (e->par) {
-        return lenv_get(e->par, k);
-    } else {
-        /* if no symbol found return error */
-        return lval_err("unbound symbol %s!", k->sym);
+    /* not found: grow the table if it is getting full and rehash */
+    if ((lsyms.count + 1) * 2 > lsyms.cap) {
+        int cap = lsyms.cap;
+        char **names = lsyms.names;
+
+        lsyms.cap = cap ? cap * 2 : 256;
+        lsyms.names = calloc(lsyms.cap, sizeof(char *));
+        mask = lsyms.cap - 1;
+        for (int i = 0; i < cap; i++) {
+            if (!names[i]) {continue;}
+            unsigned long j = lsym_hash(names[i]) & mask;
+            while (lsyms.names[j]) {j = (j + 1) & mask;}
+            lsyms.names[j] = names[i];
+        }
+        free(names);
+    }
+
+    unsigned long i = lsym_hash(name) & mask;
+    while (lsyms.names[i]) {i = (i + 1) & mask;}
+    lsym *sym = malloc(sizeof(lsym) + strlen(name) + 1);
+    sym->shadows = 0;
+    strcpy(sym->name, name);
+    lsyms.names[i] = sym->name;
+    lsyms.count++;
+
+    return lsyms.names[i];
+}
+
+/* hash of an interned symbol, taken from its address */
+unsigned long lenv_hash(char *sym) {
+    unsigned long h = (uintptr_t)sym >> 4;
+    h ^= h >> 16;
+    h *= 0x45d9f3bUL;
+    h ^= h >> 16;
+
+    return h;
+}
+
+/* find the slot of 'sym' in this frame only, -1 if it is not bound here */
+int lenv_slot(lenv *e, char *sym) {
+    /* small frames are scanned linearly */
+    if (e->cap == 0) {
+        for (int i = 0; i < e->count; i++) {
+            if (e->syms[i] == sym) {return i;}
+        }
+        return -1;
+    }
+
+    /* otherwise probe the table until an empty slot is hit */
+    unsigned long mask = e->cap - 1;
+    unsigned long i = lenv_hash(sym) & mask;
+    while (e->syms[i]) {
+        if (e->syms[i] == sym) {return i;}
+        i = (i + 1) & mask;
+    }
+
+    return -1;
+}
+
+/* 1 if every symbol bound in frame f is also bound in frame e, so a
+   lookup through e never gets as far as f */
+int lenv_shadows(lenv *e, lenv *f) {
+    if (f->count > e->count) {return 0;}
+
+    int n = f->cap ? f->cap : f->count;
+    for (int i = 0; i < n; i++) {
+        if (f->syms[i] && lenv_slot(e, f->syms[i]) < 0) {return 0;}
+    }
+
+    return 1;
+}
+
+/* double the hash table (or convert a small frame into one) and
+   reinsert every binding */
+void lenv_grow(lenv *e) {
+    int n = e->cap ? e->cap : e->count;
+    char **syms = e->syms;
+    lval **vals = e->vals;
+
+    e->cap = e->cap ? e->cap * 2 : LENV_SMALL * 4;
+    e->syms = lcells_alloc(e->cap);
+    e->vals = lcells_alloc(e->cap);
+    memset(e->syms, 0, sizeof(char *) * e->cap);
+
+    unsigned long mask = e->cap - 1;
+    for (int i = 0; i < n; i++) {
+        if (!syms[i]) {continue;}
+        unsigned long j = lenv_hash(syms[i]) & mask;
+        while (e->syms[j]) {j = (j + 1) & mask;}
+        e->syms[j] = syms[i];
+        e->vals[j] = vals[i];
+    }
+
+    lcells_free(syms, n);
+    lcells_free(vals, n);
+}
+
+lval *lenv_get(lenv *e, lval *k) {
+    /* a symbol bound nowhere but in the global environment can be
+       looked up there directly */
+    if (LSYM(k->sym)->shadows == 0) {e = lgc.env;}
+
+    /* walk up the scopes looking for the symbol
+       if it is found, return a reference to the value */
+    while (e) {
+        int i = lenv_slot(e, k->sym);
+        if (i >= 0) {
+            return lval_ref(e->vals[i]);
+        }
+        e = e->par;
     }
+
+    /* if no symbol found return error */
+    return lval_err("unbound symbol %s!", k->sym);
 }
 
 lenv *lenv_copy(lenv *e) {
-    lenv *n = malloc(sizeof(lenv));
+    lenv *n = lenv_alloc();
+    int size = e->cap ? e->cap : e->count;
 
     n->par = e->par;
     n->count = e->count;
-    n->syms = malloc(sizeof(char *) * n->count);
-    n->vals = malloc(sizeof(lval *) * n->count);
-
-    for (int i = 0; i < e->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+    n->cap = e->cap;
+    n->syms = lcells_alloc(size);
+    n->vals = lcells_alloc(size);
+
+    /* slots are copied as they are so the hash layout stays valid */
+    for (int i = 0; i < size; i++) {
+        if (!e->syms[i]) {
+            n->syms[i] = NULL;
+            n->vals[i] = NULL;
+            continue;
+        }
+        n->syms[i] = e->syms[i];
+        n->vals[i] = lval_ref(e->vals[i]);
+        LSYM(n->syms[i])->shadows++;
     }
 
     return n;
 }
 
 void lenv_put(lenv *e, lval *k, lval *v) {
-    /* iterate over all items in environment
-       this is to see if variable already exists */
-    for (int i = 0; i < e->count; i++) {
-        /* if variable is found delete item at that postion
-           and replace with variable supplied by user */
-        if (strcmp(e->syms[i], k->sym) == 0){
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
-        }
+    /* if variable already exists delete item at that postion
+       and replace with variable supplied by user */
+    int i = lenv_slot(e, k->sym);
+    if (e == lgc.env) {
+        lic.version++;
+    } else if (i < 0) {
+        LSYM(k->sym)->shadows++;
+    }
+
+    if (i >= 0) {
+        lval_del(e->vals[i]);
+        e->vals[i] = lval_ref(v);
+        return;
+    }
+
+    /* keep the table at most three quarters full */
+    if (e->cap ? (e->count + 1) * 4 > e->cap * 3
+               : e->count == LENV_SMALL) {
+        lenv_grow(e);
+    }
+
+    if (e->cap == 0) {
+        /* small frame: append a new entry */
+        i = e->count;
+        e->vals = lcells_realloc(e->vals, e->count, e->count + 1);
+        e->syms = lcells_realloc(e->syms, e->count, e->count + 1);
+    } else {
+        /* hashed frame: claim the first empty slot of the probe */
+        unsigned long mask = e->cap - 1;
+        unsigned long j = lenv_hash(k->sym) & mask;
+        while (e->syms[j]) {j = (j + 1) & mask;}
+        i = j;
     }
-    /* if no existing entry found allocate space for new entry */
     e->count++;
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
 
-    /* copy content of lval and symbol string into new location */
-    e->vals[e->count-1] = lval_copy(v);
-    e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-    strcpy(e->syms[e->count-1], k->sym);
+    /* share the value and the symbol with the new location */
+    e->vals[i] = lval_ref(v);
+    e->syms[i] = k->sym;
 }
 
 void lenv_def(lenv *e, lval *k, lval *v) {
@@ -317,19 +1029,71 @@ void lenv_def(lenv *e, lval *k, lval *v) {
     lenv_put(e, k, v);
 }
 
-/* construct a pointer to a new number lval */
+/* construct a number lval, a tagged immediate when x fits in one */
 lval *lval_num(long x) {
-    lval *v = malloc(sizeof(lval));
+    if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX) {
+        return (lval *)(((uintptr_t)x << 1) | 1);
+    }
+
+    lval *v = lval_alloc();
     v->type = LVAL_NUM;
+    v->refs = 1;
     v->num = x;
 
     return v;
 }
 
+long lval_to_num(lval *v) {
+    if (LVAL_IS_FIXNUM(v)) {return (intptr_t)v >> 1;}
+    return v->num;
+}
+
+/* construct a double lval, a flonum when x can be one */
+lval *lval_dbl(double x) {
+#if UINTPTR_MAX == UINT64_MAX
+    uint64_t b;
+    memcpy(&b, &x, sizeof(b));
+    int e = (b >> 60) & 7;
+    if ((e == 3 || e == 4) && b != 0x3000000000000000) {
+        return (lval *)(uintptr_t)(((b << 3 | b >> 61) & ~(uint64_t)1) | 2);
+    }
+    if (b == 0) {return (lval *)LVAL_FLONUM_ZERO;}
+#endif
+
+    lval *v = lval_alloc();
+    v->type = LVAL_DBL;
+    v->refs = 1;
+    v->dbl = x;
+
+    return v;
+}
+
+double lval_to_dbl(lval *v) {
+#if UINTPTR_MAX == UINT64_MAX
+    if (LVAL_IS_FLONUM(v)) {
+        if ((uintptr_t)v == LVAL_FLONUM_ZERO) {return 0.0;}
+        /* the lowest exponent bit decides the two above it */
+        uint64_t b = (uintptr_t)v;
+        b = (2 - (b >> 63)) | (b & ~(uint64_t)3);
+        b = b >> 3 | b << 61;
+        double x;
+        memcpy(&x, &b, sizeof(x));
+        return x;
+    }
+#endif
+    return v->dbl;
+}
+
+int lval_type(lval *v) {
+    if (LVAL_IS_IMM(v)) {return LVAL_IS_FIXNUM(v) ? LVAL_NUM : LVAL_DBL;}
+    return v->type;
+}
+
 /* construct a pointer to a new err lval */
 lval *lval_err(char *fmt, ...) {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_ERR;
+    v->refs = 1;
 
     /* create a va list and initialize it */
     va_list va;
@@ -352,8 +1116,9 @@ lval *lval_err(char *fmt, ...) {
 
 lval *lval_lambda(lval *formals, lval *body)
 {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_FUN;
+    v->refs = 1;
 
     /* set Builtin to NULL */
     v->builtin = NULL;
@@ -369,9 +1134,10 @@ lval *lval_lambda(lval *formals, lval *body)
 }
 
 lval *lval_fun(lbuiltin func) {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
 
     v->type = LVAL_FUN;
+    v->refs = 1;
     v->builtin = func;
 
     return v;
@@ -380,33 +1146,74 @@ lval *lval_fun(lbuiltin func) {
 /* construct a pointer to a new symbol lval */
 lval *lval_sym(char *m)
 {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
 
     v->type = LVAL_SYM;
-    v->sym = malloc(strlen(m)+1);
-    strcpy(v->sym, m);
+    v->refs = 1;
+    v->sym = lsym_intern(m);
 
     return v;
 }
 
 lval *lval_str(char *s)
 {
-    lval *v = malloc(sizeof(lval));
+    return lval_strn(s, strlen(s));
+}
+
+/* construct a string of the n bytes at s */
+lval *lval_strn(char *s, long n)
+{
+    lval *v = lval_alloc();
 
     v->type = LVAL_STR;
-    v->str = malloc(strlen(s)+1);
-    strcpy(v->str, s);
+    v->refs = 1;
+    v->slen = n;
+    v->str = n < LSTR_SMALL ? v->small : malloc(n + 1);
+    memcpy(v->str, s, n);
+    v->str[n] = '\0';
 
     return v;
 }
 
+/* construct an empty string builder, see lstr_add */
+lval *lval_builder(void)
+{
+    lval *v = lval_alloc();
+
+    v->type = LVAL_BUILDER;
+    v->refs = 1;
+    v->slen = 0;
+    v->scap = LSTR_SMALL * 4;
+    v->str = malloc(v->scap);
+    v->str[0] = '\0';
+
+    return v;
+}
+
+/* append the n bytes at s to builder b, doubling its room as needed so
+   that building a string piece by piece takes time linear in its length */
+void lstr_add(lval *b, char *s, long n)
+{
+    if (b->slen + n + 1 > b->scap) {
+        while (b->slen + n + 1 > b->scap) {b->scap *= 2;}
+        b->str = realloc(b->str, b->scap);
+    }
+    memcpy(b->str + b->slen, s, n);
+    b->slen += n;
+    b->str[b->slen] = '\0';
+}
+
 /* a pointer to a new empty sexpr lval */
 lval *lval_sexpr(void)
 {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_SEXPR;
+    v->refs = 1;
     v->count = 0;
+    v->cap = 0;
     v->cell=NULL;
+    v->base = NULL;
+    v->code = NULL;
 
     return v;
 }
@@ -414,44 +1221,362 @@ lval *lval_sexpr(void)
 /* a pointer to a new empty Qexpr lval */
 lval *lval_qexpr(void)
 {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_QEXPR;
+    v->refs = 1;
     v->count = 0;
+    v->cap = 0;
     v->cell=NULL;
+    v->base = NULL;
+    v->code = NULL;
 
     return v;
 }
 
 void lval_del(struct lval *v)
+{
+    /* immediates are not allocated, and
+       only the last owner actually frees the value */
+    if (LVAL_IS_IMM(v) || --v->refs > 0) {return;}
+
+    /* while a value is being freed, the values it releases in turn
+       wait on a stack rather than being freed recursively */
+    if (ldel.busy) {
+        lstack_push(&ldel.pending, v, 0);
+        return;
+    }
+
+    ldel.busy = 1;
+    lval_release(v, 1);
+    while (ldel.pending.count) {
+        lval_release(ldel.pending.items[--ldel.pending.count].v, 1);
+    }
+    ldel.busy = 0;
+}
+
+/* free v; with release set its last reference is gone and the values
+   it refers to are released too, otherwise it is garbage found by the
+   collector and only the buffers it owns are freed */
+void lval_release(lval *v, int release)
 {
     switch(v->type) {
     case LVAL_FUN:
-        if (!v->builtin) {
+        if (release && !v->builtin) {
             lenv_del(v->env);
             lval_del(v->formals);
             lval_del(v->body);
         }
         break;
     case LVAL_NUM: break;
+    case LVAL_DBL: break;
+    case LVAL_BIG: free(v->big); break;
     case LVAL_ERR: free(v->err); break;
-    case LVAL_SYM: free(v->sym); break;
-    case LVAL_STR: free(v->str); break;
+    case LVAL_SYM: break;
+    case LVAL_STR:
+    case LVAL_BUILDER:
+        if (v->str != v->small) {free(v->str);}
+        break;
     case LVAL_SEXPR:
     case LVAL_QEXPR:
-        for(int i = 0; i < v->count; i++) {
-            lval_del(v->cell[i]);
+        if (v->code) {lcode_del(v->code, release);}
+        /* a view only holds a reference to the list it looks into */
+        if (v->base) {
+            if (release) {lval_del(v->base);}
+            break;
+        }
+        if (release) {
+            for(int i = 0; i < v->count; i++) {
+                lval_del(v->cell[i]);
+            }
         }
-        free(v->cell);
+        lcells_free(v->cell, v->cap);
         break;
     }
+    lval_free(v);
+}
 
-    free(v);
+lval *lval_alloc(void) {
+    lval *v = lpool_alloc(&lalloc.pools[LPOOL_VAL]);
+    lgc_link(&v->gc, LOBJ_VAL, sizeof(lval));
+
+    return v;
+}
+
+void lval_free(lval *v) {
+    lgc_unlink(&v->gc);
+    lpool_free(&lalloc.pools[LPOOL_VAL], v);
+}
+
+lenv *lenv_alloc(void) {
+    lenv *e = lpool_alloc(&lalloc.pools[LPOOL_ENV]);
+    lgc_link(&e->gc, LOBJ_ENV, sizeof(lenv));
+
+    return e;
+}
+
+void lenv_free(lenv *e) {
+    lgc_unlink(&e->gc);
+    lpool_free(&lalloc.pools[LPOOL_ENV], e);
+}
+
+void *lpool_alloc(lpool *p) {
+    p->allocs++;
+#ifdef LALLOC_MALLOC
+    return malloc(p->size);
+#else
+    /* reuse a freed block if there is one */
+    if (p->free) {
+        void *b = p->free;
+        p->free = *(void **)b;
+        p->hits++;
+        return b;
+    }
+
+    /* otherwise carve the next block out of the current slab */
+    if (p->bump + p->size > p->end) {
+        uintptr_t slab = (uintptr_t)malloc(LSLAB_SIZE + LSLAB_ALIGN - 1);
+        slab = (slab + LSLAB_ALIGN - 1) & ~(uintptr_t)(LSLAB_ALIGN - 1);
+        p->bump = (char *)slab;
+        p->end = p->bump + LSLAB_SIZE;
+        p->slabs++;
+    }
+    void *b = p->bump;
+    p->bump += p->size;
+
+    return b;
+#endif
+}
+
+/* push a block on the free list, slabs are never given back */
+void lpool_free(lpool *p, void *b) {
+#ifdef LALLOC_MALLOC
+    free(b);
+#else
+    *(void **)b = p->free;
+    p->free = b;
+#endif
+}
+
+/* index of the smallest cell pool holding n pointers,
+   LCELL_CLASSES if n is too large for any pool */
+int lcells_class(int n) {
+    int k = 0;
+    while (k < LCELL_CLASSES && (1 << k) < n) {k++;}
+
+    return k;
+}
+
+/* an array of n pointers, NULL for an empty array */
+void *lcells_alloc(int n) {
+    if (n == 0) {return NULL;}
+
+    int k = lcells_class(n);
+    if (k == LCELL_CLASSES) {
+        lalloc.large++;
+        return malloc(sizeof(void *) * n);
+    }
+
+    return lpool_alloc(&lalloc.pools[LPOOL_CELLS + k]);
+}
+
+/* resize an array of n pointers to m, keeping its contents */
+void *lcells_realloc(void *c, int n, int m) {
+    int k = lcells_class(n);
+    if (n > 0 && m > 0 && k == lcells_class(m)) {
+        if (k == LCELL_CLASSES) {c = realloc(c, sizeof(void *) * m);}
+        return c;
+    }
+
+    void *x = lcells_alloc(m);
+    if (n > 0 && m > 0) {memcpy(x, c, sizeof(void *) * (n < m ? n : m));}
+    lcells_free(c, n);
+
+    return x;
+}
+
+void lcells_free(void *c, int n) {
+    if (n == 0) {return;}
+
+    int k = lcells_class(n);
+    if (k == LCELL_CLASSES) {
+        free(c);
+    } else {
+        lpool_free(&lalloc.pools[LPOOL_CELLS + k], c);
+    }
+}
+
+void lgc_init(void) {
+    lgc.objs.gc_next = lgc.objs.gc_prev = &lgc.objs;
+}
+
+/* add a freshly allocated object to the list of all objects */
+void lgc_link(lobj *o, int kind, long size) {
+    o->kind = kind;
+    o->mark = 0;
+    o->gc_prev = &lgc.objs;
+    o->gc_next = lgc.objs.gc_next;
+    lgc.objs.gc_next->gc_prev = o;
+    lgc.objs.gc_next = o;
+
+    lgc.objects++;
+    lgc.allocated += size;
+}
+
+void lgc_unlink(lobj *o) {
+    o->gc_prev->gc_next = o->gc_next;
+    o->gc_next->gc_prev = o->gc_prev;
+    lgc.objects--;
+}
+
+/* keep v alive across safe points until the matching lgc_unroot */
+void lstack_push(lstack *s, lval *v, int i) {
+    if (s->count == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 64;
+        s->items = realloc(s->items, sizeof(lwalk) * s->cap);
+    }
+    s->items[s->count].v = v;
+    s->items[s->count].i = i;
+    s->count++;
+}
+
+void lgc_root(lval *v) {
+    if (lgc.nroots == lgc.maxroots) {
+        lgc.maxroots = lgc.maxroots ? lgc.maxroots * 2 : 16;
+        lgc.roots = realloc(lgc.roots, sizeof(lval *) * lgc.maxroots);
+    }
+    lgc.roots[lgc.nroots++] = v;
+}
+
+void lgc_unroot(void) {
+    lgc.nroots--;
+}
+
+/* mark v, leaving what it refers to for lgc_trace */
+void lgc_mark_val(lval *v) {
+    if (LVAL_IS_IMM(v) || v->gc.mark) {return;}
+    v->gc.mark = 1;
+    lgc.live_bytes += sizeof(lval);
+    lstack_push(&lgc.gray, v, 0);
+}
+
+/* mark everything reachable from the marked values */
+void lgc_trace(void) {
+    while (lgc.gray.count) {
+        lval *v = lgc.gray.items[--lgc.gray.count].v;
+
+        switch(v->type) {
+        case LVAL_FUN:
+            if (!v->builtin) {
+                lgc_mark_env(v->env);
+                lgc_mark_val(v->formals);
+                lgc_mark_val(v->body);
+            }
+            break;
+        case LVAL_ERR: lgc.live_bytes += strlen(v->err) + 1; break;
+        case LVAL_BIG: lgc.live_bytes += sizeof(uint32_t) * v->blen; break;
+        case LVAL_STR:
+            if (v->str != v->small) {lgc.live_bytes += v->slen + 1;}
+            break;
+        case LVAL_BUILDER: lgc.live_bytes += v->scap; break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (v->code) {lgc_mark_code(v->code);}
+            if (v->base) {
+                lgc_mark_val(v->base);
+                break;
+            }
+            lgc.live_bytes += sizeof(lval *) * v->cap;
+            for (int i = 0; i < v->count; i++) {
+                lgc_mark_val(v->cell[i]);
+            }
+            break;
+        }
+    }
+}
+
+void lgc_mark_code(lcode *c) {
+    lgc.live_bytes += sizeof(lcode) + sizeof(int) * c->cap
+        + sizeof(lval *) * c->maxconsts;
+    for (int i = 0; i < c->nconsts; i++) {
+        lgc_mark_val(c->consts[i]);
+    }
+}
+
+/* the parent of an environment is not owned by it, so it is not marked */
+void lgc_mark_env(lenv *e) {
+    if (e->gc.mark) {return;}
+    e->gc.mark = 1;
+
+    int n = e->cap ? e->cap : e->count;
+    lgc.live_bytes += sizeof(lenv) + (sizeof(char *) + sizeof(lval *)) * n;
+    for (int i = 0; i < n; i++) {
+        if (e->syms[i]) {lgc_mark_val(e->vals[i]);}
+    }
+}
+
+/* The roots are the global environment and the values pushed with
+   lgc_root, such as the forms of a file being loaded. Neither the
+   evaluator's C stack nor the VM's value stack is a root, so values a
+   builtin or a running function holds in locals would be swept from
+   under it. Collection therefore only happens at lgc_safepoint,
+   between top-level forms. One long-running form never collects: its
+   garbage waits for the next safepoint, while reference counting still
+   frees whatever is not part of a cycle. */
+void lgc_collect(void) {
+    clock_t start = clock();
+
+    /* mark everything reachable from the roots */
+    lgc.live_bytes = 0;
+    lgc_mark_env(lgc.env);
+    for (int i = 0; i < lgc.nroots; i++) {
+        lgc_mark_val(lgc.roots[i]);
+    }
+    lgc_trace();
+
+    /* free everything else, without touching reference counts since
+       whatever points at an unmarked object is garbage too */
+    lobj *next;
+    for (lobj *o = lgc.objs.gc_next; o != &lgc.objs; o = next) {
+        next = o->gc_next;
+        if (o->mark) {
+            o->mark = 0;
+            continue;
+        }
+
+        if (o->kind == LOBJ_ENV) {
+            lenv_release((lenv *)o, 0);
+        } else {
+            lval_release((lval *)o, 0);
+        }
+        lgc.freed++;
+    }
+
+    lgc.allocated = 0;
+    lgc.collections++;
+    lgc.last_pause = (long)((clock() - start) * 1000000.0 / CLOCKS_PER_SEC);
+    lgc.total_pause += lgc.last_pause;
+    if (lgc.last_pause > lgc.max_pause) {lgc.max_pause = lgc.last_pause;}
+}
+
+/* collect if enough has been allocated, only call this at the top level */
+void lgc_safepoint(void) {
+    if (lgc.allocated >= LGC_HEAP_STEP) {lgc_collect();}
 }
 
 void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
     lval *k = lval_sym(name);
     lval *v = lval_fun(func);
 
+    if (lbuiltins.count == lbuiltins.cap) {
+        lbuiltins.cap = lbuiltins.cap ? lbuiltins.cap * 2 : 64;
+        lbuiltins.names = realloc(lbuiltins.names,
+                                  sizeof(char *) * lbuiltins.cap);
+        lbuiltins.funcs = realloc(lbuiltins.funcs,
+                                  sizeof(lbuiltin) * lbuiltins.cap);
+    }
+    lbuiltins.names[lbuiltins.count] = k->sym;
+    lbuiltins.funcs[lbuiltins.count++] = func;
+
     lenv_put(e, k, v);
     lval_del(k);
     lval_del(v);
@@ -464,6 +1589,20 @@ void lenv_add_builtins(lenv *e) {
     lenv_add_builtin(e, "tail", builtin_tail);
     lenv_add_builtin(e, "eval", builtin_eval);
     lenv_add_builtin(e, "join", builtin_join);
+    lenv_add_builtin(e, "len", builtin_len);
+    lenv_add_builtin(e, "nth", builtin_nth);
+    lenv_add_builtin(e, "last", builtin_last);
+    lenv_add_builtin(e, "init", builtin_init);
+    lenv_add_builtin(e, "take", builtin_take);
+    lenv_add_builtin(e, "drop", builtin_drop);
+    lenv_add_builtin(e, "reverse", builtin_reverse);
+    lenv_add_builtin(e, "elem", builtin_elem);
+    lenv_add_builtin(e, "map", builtin_map);
+    lenv_add_builtin(e, "filter", builtin_filter);
+    lenv_add_builtin(e, "foldl", builtin_foldl);
+    lenv_add_builtin(e, "foldr", builtin_foldr);
+    lenv_add_builtin(e, "zip", builtin_zip);
+    lenv_add_builtin(e, "unzip", builtin_unzip);
 
     /* mathematical functions */
     lenv_add_builtin(e, "+", builtin_add);
@@ -475,9 +1614,14 @@ void lenv_add_builtins(lenv *e) {
     lenv_add_builtin(e, "\\", builtin_lambda);
     lenv_add_builtin(e, "def", builtin_def);
     lenv_add_builtin(e, "=",   builtin_put);
+    lenv_add_builtin(e, "fun", builtin_fun);
+    lenv_add_builtin(e, "let", builtin_let);
+    lenv_add_builtin(e, "do", builtin_do);
 
     /* Comparison functions */
     lenv_add_builtin(e, "if", builtin_if);
+    lenv_add_builtin(e, "select", builtin_select);
+    lenv_add_builtin(e, "case", builtin_case);
     lenv_add_builtin(e, "==", builtin_eq);
     lenv_add_builtin(e, "!=", builtin_ne);
     lenv_add_builtin(e, ">", builtin_gt);
@@ -487,110 +1631,370 @@ void lenv_add_builtins(lenv *e) {
 
     /* String functions */
     lenv_add_builtin(e, "load", builtin_load);
+    lenv_add_builtin(e, "import", builtin_import);
     lenv_add_builtin(e, "error", builtin_error);
     lenv_add_builtin(e, "print", builtin_print);
+    lenv_add_builtin(e, "str-len", builtin_str_len);
+    lenv_add_builtin(e, "substr", builtin_substr);
+    lenv_add_builtin(e, "str-concat", builtin_str_concat);
+    lenv_add_builtin(e, "str-join", builtin_str_join);
+    lenv_add_builtin(e, "str-split", builtin_str_split);
+    lenv_add_builtin(e, "str-builder", builtin_str_builder);
+    lenv_add_builtin(e, "str-add", builtin_str_add);
+    lenv_add_builtin(e, "str-build", builtin_str_build);
+
+    /* Runtime functions */
+    lenv_add_builtin(e, "gc-stats", builtin_gc_stats);
 }
 
-lval *lval_read_num(mpc_ast_t *t) {
-    errno = 0;
-    long x = strtol(t->contents, NULL, 10);
-    return errno != ERANGE ?
-        lval_num(x) : lval_err("invalid number");
-}
+/* make room for at least n items in list v */
+void lval_reserve(lval *v, int n) {
+    lvm_forget(v);
+    lval_unview(v);
+    if (n <= v->cap) {return;}
 
-lval *lval_read_str(mpc_ast_t *t) {
-    /*Cut off the final quote character*/
-    t->contents[strlen(t->contents)-1] = '\0';
-    /*copy the string missing out the first quote character*/
-    char *unescaped = malloc(strlen(t->contents+1)+1);
-    strcpy(unescaped, t->contents+1);
-    /*pass throuth the unescaped function*/
-    unescaped = mpcf_unescape(unescaped);
-    /*construct a new lval using the string*/
-    lval *str = lval_str(unescaped);
+    /* grow geometrically so appending n items costs O(n) */
+    int cap = v->cap ? v->cap : 4;
+    while (cap < n) {cap *= 2;}
 
-    /*free the string and return*/
-    free(unescaped);
-    return str;
+    v->cell = lcells_realloc(v->cell, v->cap, cap);
+    v->cap = cap;
 }
 
 lval *lval_add(lval *v, lval *x) {
+    lval_reserve(v, v->count + 1);
     v->count++;
-    v->cell = realloc(v->cell, sizeof(lval *) * v->count);
     v->cell[v->count-1]=x;
 
     return v;
 }
 
-lval *lval_read(mpc_ast_t *t) {
-    /* if symbol or number return conversion to that type */
-    if(strstr(t->tag, "number")) {return lval_read_num(t);}
-    if(strstr(t->tag, "symbol")) {return lval_sym(t->contents);}
-    if(strstr(t->tag, "string")) {return lval_read_str(t);}
+/* Escape sequences in strings, and the characters they stand for */
+char lstr_escapes[] = "abfnrtv\\'\"0";
+char lstr_chars[] = {'\a', '\b', '\f', '\n', '\r', '\t', '\v',
+                     '\\', '\'', '"', '\0'};
+
+/* Reader. Source text is scanned in a single pass straight into lvals,
+   with no tree in between: numbers, interned symbols, strings and
+   lists, skipping whitespace and comments. The text runs from 'p' to
+   'end' and is never written to, so it can be a file mapped read only
+   (see builtin_load). Each call to lread_form reads one top level form,
+   the lists being read waiting on a stack on the heap, so how deep they
+   nest is not limited by the C stack. */
+lval *lread_form(lreader *r) {
+    lval *x = NULL;/* the list being read, NULL at the top level */
+    lval *v = NULL;/* the value just read */
+
+    while (r->p < r->end) {
+        char *start = r->p;
+        char c = *r->p;
+
+        if (c == '\n') {
+            r->line++;
+            r->p++;
+        } else if (c == ' ' || c == '\f' || c == '\r' || c == '\t'
+                   || c == '\v') {
+            r->p++;
+        } else if (c == ';') {
+            /* comments run to the end of the line */
+            while (r->p < r->end && *r->p != '\n' && *r->p != '\r') {
+                r->p++;
+            }
+        } else if (c == '(' || c == '{') {
+            lstack_push(&r->open, x, r->line);
+            x = c == '(' ? lval_sexpr() : lval_qexpr();
+            r->p++;
+        } else if (c == ')' || c == '}') {
+            int type = c == ')' ? LVAL_SEXPR : LVAL_QEXPR;
+            if (!x || x->type != type) {
+                v = lval_err("line %i: unexpected '%c'", r->line, c);
+                r->p++;
+                break;
+            }
+            v = x;
+            x = r->open.items[--r->open.count].v;
+            r->p++;
+        } else if (c == '"') {
+            /* unescaped into the scratch buffer, then copied */
+            int n = 0;
+            for (r->p++; r->p < r->end && *r->p != '"'; n++) {
+                char *e = NULL;
+                if (*r->p == '\n') {r->line++;}
+                if (*r->p == '\\' && r->p + 1 < r->end && r->p[1]) {
+                    e = strchr(lstr_escapes, r->p[1]);
+                }
+                lread_reserve(r, n + 2);
+                if (e) {
+                    r->buf[n] = lstr_chars[e - lstr_escapes];
+                    r->p += 2;
+                } else {
+                    /* an unknown escape is kept, but still escapes */
+                    if (*r->p == '\\' && r->p + 1 < r->end) {
+                        r->buf[n++] = *r->p++;
+                    }
+                    r->buf[n] = *r->p++;
+                }
+            }
+            if (r->p == r->end) {
+                v = lval_err("line %i: unterminated string", r->line);
+                break;
+            }
+            r->p++;
+            v = lval_strn(r->buf, n);
+        } else if ((c >= '0' && c <= '9')
+                   || (c == '-' && r->p + 1 < r->end
+                       && r->p[1] >= '0' && r->p[1] <= '9')) {
+            /* summed negatively, as LONG_MIN has no positive twin */
+            long n = 0;
+            int neg = c == '-';
+            int range = 1;
+            for (r->p += neg; r->p < r->end
+                     && *r->p >= '0' && *r->p <= '9'; r->p++) {
+                int d = *r->p - '0';
+                if (n < (LONG_MIN + d) / 10) {range = 0;}
+                n = range ? n * 10 - d : 0;
+            }
+            if (!neg && n == LONG_MIN) {range = 0;}
 
-    /* if root (>) or sexpr then create empty list */
-    lval *x = NULL;
-    if (strcmp(t->tag, ">") == 0) {x = lval_sexpr();}
-    if (strstr(t->tag, "sexpr"))  {x = lval_sexpr();}
-    if (strstr(t->tag, "qexpr"))  {x = lval_qexpr();}
+            /* a fraction or an exponent make it a double */
+            char *q = r->p;
+            if (q + 1 < r->end && *q == '.' && q[1] >= '0' && q[1] <= '9') {
+                q = lread_digits(q + 1, r->end);
+            }
+            if (q < r->end && (*q == 'e' || *q == 'E')) {
+                char *d = q + 1;
+                if (d < r->end && (*d == '+' || *d == '-')) {d++;}
+                if (d < r->end && *d >= '0' && *d <= '9') {
+                    q = lread_digits(d, r->end);
+                }
+            }
 
-    /* fill this list with any valid expression contained within */
-    for (int i = 0; i < t->children_num; i++) {
-        if (strcmp(t->children[i]->contents, "(") == 0) {continue;}
-        if (strcmp(t->children[i]->contents, ")") == 0) {continue;}
-        if (strcmp(t->children[i]->contents, "{") == 0) {continue;}
-        if (strcmp(t->children[i]->contents, "}") == 0) {continue;}
-        if (strcmp(t->children[i]->tag,  "regex") == 0) {continue;}
-        if(strstr(t->children[i]->tag, "comment")) {continue;}
-        x = lval_add(x, lval_read(t->children[i]));
-    }
+            if (q != r->p) {
+                r->p = q;
+                lread_reserve(r, q - start + 1);
+                memcpy(r->buf, start, q - start);
+                r->buf[q - start] = '\0';
+                v = lval_dbl(strtod(r->buf, NULL));
+            } else if (range) {
+                v = lval_num(neg ? n : -n);
+            } else {
+                v = lbig_read(start + neg, r->p, neg);
+            }
+        } else if (lread_symchar(c)) {
+            while (r->p < r->end && lread_symchar(*r->p)) {r->p++;}
+            int n = r->p - start;
+            lread_reserve(r, n + 1);
+            memcpy(r->buf, start, n);
+            r->buf[n] = '\0';
+            v = lval_sym(r->buf);
+        } else {
+            v = lval_err("line %i: unexpected '%c'", r->line, c);
+            r->p++;
+            break;
+        }
+
+        /* a value read is a form if it is not in a list */
+        if (v) {
+            if (!x) {return v;}
+            lval_add(x, v);
+            v = NULL;
+        }
+    }
+
+    if (!v && x) {
+        v = lval_err("line %i: unclosed '%c'",
+                     r->open.items[r->open.count - 1].i,
+                     x->type == LVAL_SEXPR ? '(' : '{');
+    }
+    if (x) {
+        lval_del(x);
+        while (r->open.count) {
+            lval *o = r->open.items[--r->open.count].v;
+            if (o) {lval_del(o);}
+        }
+    }
+
+    return v;
+}
+
+/* make room for n characters in the scratch buffer of r */
+void lread_reserve(lreader *r, int n) {
+    if (n <= r->cap) {return;}
+    while (r->cap < n) {r->cap = r->cap ? r->cap * 2 : 256;}
+    r->buf = realloc(r->buf, r->cap);
+}
 
+void lread_free(lreader *r) {
+    free(r->open.items);
+    free(r->buf);
+}
+
+/* read all of 's', for the REPL: an S-Expression of the forms read, or
+   an error at the first thing that is not a form */
+lval *lval_read(char *s) {
+    lreader r = {s, s + strlen(s), 1};
+    lval *x = lval_sexpr();
+
+    lval *v;
+    while ((v = lread_form(&r))) {
+        if (lval_type(v) == LVAL_ERR) {
+            lval_del(x);
+            x = v;
+            break;
+        }
+        lval_add(x, v);
+    }
+
+    lread_free(&r);
     return x;
 }
 
-void lval_expr_print(lval *v, char open, char close) {
-    putchar(open);
-    for(int i = 0; i < v->count; i++) {
-        /* print value contained within */
-        lval_print(v->cell[i]);
+/* the end of the digits starting at p */
+char *lread_digits(char *p, char *end) {
+    while (p < end && *p >= '0' && *p <= '9') {p++;}
+    return p;
+}
+
+int lread_symchar(int c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+        || (c >= '0' && c <= '9') || (c && strchr("_+-*/\\=<>!&", c));
+}
 
-        /* don't print trailing space if last element */
-        if (i != (v->count-1)) {
-            putchar(' ');
+/* map file 'name' into memory read only, setting *size to its length,
+   or return NULL with errno set. Release it with lfile_unmap. */
+char *lfile_map(char *name, long *size) {
+#ifdef _WIN32
+    /* no mmap: read it into a buffer instead */
+    FILE *f = fopen(name, "rb");
+    if (!f) {return NULL;}
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *p = malloc(*size + 1);
+    if (fread(p, 1, *size, f) != (size_t)*size) {
+        free(p);
+        p = NULL;
+    }
+    fclose(f);
+    return p;
+#else
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {return NULL;}
+
+    struct stat st;
+    char *p = NULL;
+    if (fstat(fd, &st) == 0) {
+        *size = st.st_size;
+        /* an empty file cannot be mapped */
+        p = *size ? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+        if (p == MAP_FAILED) {
+            p = NULL;
+        } else if (*size) {
+            madvise(p, *size, MADV_SEQUENTIAL);
         }
     }
+    close(fd);
+    return p;
+#endif
+}
+
+void lfile_unmap(char *p, long size) {
+#ifdef _WIN32
+    free(p);
+#else
+    if (size) {munmap(p, size);}
+#endif
+}
 
-    putchar(close);
+/* let the pages of the first n bytes of mapping p go, as they will not
+   be read again. Returns how many bytes were let go. */
+long lfile_drop(char *p, long n) {
+#ifdef _WIN32
+    return n;
+#else
+    long page = sysconf(_SC_PAGESIZE);
+    n -= n % page;
+    if (n) {madvise(p, n, MADV_DONTNEED);}
+    return n;
+#endif
 }
 
 void lval_print_str(lval *v) {
-    /*Make a copy of the string*/
-    char *escaped = malloc(strlen(v->str)+1);
-    strcpy(escaped, v->str);
-    /*Pass it through the escape function*/
-    escaped = mpcf_escape(escaped);
-    /*Print it between " characters*/
-    printf("\"%s\"", escaped);
-    /*free the copied string*/
-    free(escaped);
+    putchar('"');
+    for (char *c = v->str; c < v->str + v->slen; c++) {
+        char *e = strchr(lstr_chars, *c);
+        if (e) {
+            putchar('\\');
+            putchar(lstr_escapes[e - lstr_chars]);
+        } else {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
+
+/* the shortest digits that read back as x, and always a '.' or an
+   exponent so that they do not read back as an integer */
+void lval_print_dbl(double x) {
+    char s[32];
+    for (int prec = 15; prec <= 17; prec++) {
+        snprintf(s, sizeof(s), "%.*g", prec, x);
+        if (strtod(s, NULL) == x) {break;}
+    }
+    if (!strpbrk(s, ".en")) {strcat(s, ".0");}
+    printf("%s", s);
 }
 
 void lval_print(struct lval *v) {
-    switch(v->type) {
-    case LVAL_NUM: printf("%li", v->num); break;
-    case LVAL_ERR: printf("Error: %s", v->err); break;
-    case LVAL_FUN:
-        if (v->builtin) {
-            printf("<builtin>");
-        } else {
-            printf("(\\ "); lval_print(v->formals);
-            putchar(' '); lval_print(v->body); putchar(')');
+    /* lists and lambdas being printed, with the next item to print */
+    static lstack open;
+
+    while (v) {
+        switch(lval_type(v)) {
+        case LVAL_NUM: printf("%li", lval_to_num(v)); break;
+        case LVAL_DBL: lval_print_dbl(lval_to_dbl(v)); break;
+        case LVAL_BIG: lbig_print(v); break;
+        case LVAL_ERR: printf("Error: %s", v->err); break;
+        case LVAL_FUN:
+            if (v->builtin) {
+                printf("<builtin>");
+            } else {
+                printf("(\\ ");
+                lstack_push(&open, v, 0);
+            }
+            break;
+        case LVAL_SYM: printf("%s", v->sym); break;
+        case LVAL_STR: lval_print_str(v); break;
+        case LVAL_BUILDER:
+            printf("<builder ");
+            lval_print_str(v);
+            putchar('>');
+            break;
+        case LVAL_SEXPR: putchar('('); lstack_push(&open, v, 0); break;
+        case LVAL_QEXPR: putchar('{'); lstack_push(&open, v, 0); break;
+        }
+
+        /* move on to the next item, closing what has been printed */
+        v = NULL;
+        while (!v && open.count) {
+            lwalk *w = &open.items[open.count - 1];
+            if (w->v->type == LVAL_FUN) {
+                if (w->i < 2) {
+                    if (w->i) {putchar(' ');}
+                    v = w->i++ ? w->v->body : w->v->formals;
+                } else {
+                    putchar(')');
+                    open.count--;
+                }
+            } else if (w->i < w->v->count) {
+                /* don't print trailing space if last element */
+                if (w->i) {putchar(' ');}
+                v = w->v->cell[w->i++];
+            } else {
+                putchar(w->v->type == LVAL_SEXPR ? ')' : '}');
+                open.count--;
+            }
         }
-        break;
-    case LVAL_SYM: printf("%s", v->sym); break;
-    case LVAL_STR: lval_print_str(v); break;
-    case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
-    case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
     }
 }
 
@@ -641,6 +2045,16 @@ lval eval(mpc_ast_t *t)
 #endif
 
 lval *lval_pop(lval *v, int i) {
+    lvm_forget(v);
+
+    /* popping the front of a view just narrows it */
+    if (v->base && i == 0) {
+        v->cell++;
+        v->count--;
+        return lval_ref(v->cell[-1]);
+    }
+    lval_unview(v);
+
     /* find the item at 'i' */
     lval *x = v->cell[i];
 
@@ -651,23 +2065,94 @@ lval *lval_pop(lval *v, int i) {
     /* decrease the count of items int the list */
     v->count--;
 
-    /* reallocate the memory used */
-    v->cell = realloc(v->cell, sizeof(lval *) * v->count);
+    /* only give memory back once the list is a quarter full */
+    if (v->cap > 8 && v->count < v->cap / 4) {
+        v->cell = lcells_realloc(v->cell, v->cap, v->cap / 2);
+        v->cap /= 2;
+    }
 
     return x;
 }
 
 lval *lval_take(lval *v, int i) {
+    /* a shared list must stay intact, so just reference the item */
+    if (v->refs > 1 || v->base) {
+        lval *x = lval_ref(v->cell[i]);
+        lval_del(v);
+        return x;
+    }
+
     lval *x = lval_pop(v, i);
     lval_del(v);
 
     return x;
 }
 
+/* new reference to v, released again with lval_del */
+lval *lval_ref(lval *v) {
+    if (!LVAL_IS_IMM(v)) {v->refs++;}
+    return v;
+}
+
+/* return a reference to v that is safe to mutate: v itself if no one
+   else holds it, otherwise a copy of v (giving up the reference to v) */
+lval *lval_own(lval *v) {
+    if (LVAL_IS_IMM(v)) {return v;}
+    if (v->refs == 1) {
+        if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+            lvm_forget(v);
+            lval_unview(v);
+        }
+        return v;
+    }
+
+    lval *x = lval_copy(v);
+    lval_del(v);
+
+    return x;
+}
+
+/* A view is a list whose cells point into the array of another list,
+   its base, instead of an array of its own. It holds a reference to
+   the base but none to the items, so slicing is O(1). The base is
+   never a view itself, and since it is shared it is never mutated;
+   a view is turned back into a plain list before it is mutated. */
+
+/* return the items [start, end) of list v as a view, consuming v */
+lval *lval_slice(lval *v, int start, int end) {
+    lval *x = (v->type == LVAL_SEXPR) ? lval_sexpr() : lval_qexpr();
+    if (end > start) {
+        x->base = lval_ref(v->base ? v->base : v);
+        x->cap = 0;
+        x->cell = v->cell + start;
+        x->count = end - start;
+    }
+    lval_del(v);
+
+    return x;
+}
+
+/* give a view its own array of items, no-op for a plain list */
+void lval_unview(lval *v) {
+    if (!v->base) {return;}
+
+    lval **cell = lcells_alloc(v->count);
+    for (int i = 0; i < v->count; i++) {
+        cell[i] = lval_ref(v->cell[i]);
+    }
+    v->cell = cell;
+    v->cap = v->count;
+    lval_del(v->base);
+    v->base = NULL;
+}
+
+/* copy the top level of v, children are shared with the original */
 lval *lval_copy(lval *v) {
+    if (LVAL_IS_IMM(v)) {return v;}
 
-    lval *x = malloc(sizeof(lval));
+    lval *x = lval_alloc();
     x->type = v->type;
+    x->refs = 1;
 
     switch(v->type) {
         /* copy function and numbers directly */
@@ -677,30 +2162,46 @@ lval *lval_copy(lval *v) {
         } else {
             x->builtin = NULL;
             x->env = lenv_copy(v->env);
-            x->formals = lval_copy(v->formals);
-            x->body = lval_copy(v->body);
+            x->formals = lval_ref(v->formals);
+            x->body = lval_ref(v->body);
         }
         break;
     case LVAL_NUM: x->num = v->num; break;
+    case LVAL_DBL: x->dbl = v->dbl; break;
+    case LVAL_BIG:
+        x->bneg = v->bneg;
+        x->blen = v->blen;
+        x->big = malloc(sizeof(uint32_t) * v->blen);
+        memcpy(x->big, v->big, sizeof(uint32_t) * v->blen);
+        break;
 
         /* copy string using malloc and strcpy */
     case LVAL_ERR:
         x->err = malloc(strlen(v->err) + 1);
         strcpy(x->err, v->err); break;
-    case LVAL_SYM:
-        x->sym = malloc(strlen(v->sym) + 1);
-        strcpy(x->sym, v->sym); break;
+    case LVAL_SYM: x->sym = v->sym; break;
     case LVAL_STR:
-        x->str = malloc(strlen(v->str) + 1);
-        strcpy(x->str, v->str); break;
+    case LVAL_BUILDER:
+        x->slen = v->slen;
+        if (v->str == v->small) {
+            x->str = x->small;
+        } else {
+            x->scap = v->type == LVAL_BUILDER ? v->scap : v->slen + 1;
+            x->str = malloc(x->scap);
+        }
+        memcpy(x->str, v->str, v->slen + 1);
+        break;
 
-        /* copy lists by copying each sub-expression */
+        /* copy lists by referencing each sub-expression */
     case LVAL_SEXPR:
     case LVAL_QEXPR:
+        x->base = NULL;
+        x->code = NULL;
         x->count = v->count;
-        x->cell = malloc(sizeof(lval*) * x->count);
+        x->cap = v->count;
+        x->cell = lcells_alloc(x->count);
         for (int i = 0; i < x->count; i++) {
-            x->cell[i] = lval_copy(v->cell[i]);
+            x->cell[i] = lval_ref(v->cell[i]);
         }
         break;
     }
@@ -714,124 +2215,575 @@ lval *lval_call(lenv *e, lval *f, lval *a) {
         return f->builtin(e, a);
     }
 
+    lenv *frame;
+    lval *r = lval_bind(e, f, a, &frame);
+    if (!frame) {return r;}
+
+    /* Evaluate and return */
+    if (lvm.enabled) {return lvm_run(f, frame);}
+
+    r = lval_eval_sexpr(frame, f->body);
+    lenv_del(frame);
+    return r;
+}
+
+/* Bind the arguments 'a' to the formals of lambda 'f', consuming 'a'.
+   Functions are never modified: the bindings go into a new activation
+   frame that starts as a copy of the bindings 'f' has captured. When
+   every formal is bound, *frame is set to that frame (whose parent is
+   'e') and NULL is returned. Otherwise *frame is NULL and the result
+   is an error or a partially applied function capturing the frame. */
+lval *lval_bind(lenv *e, lval *f, lval *a, lenv **frame) {
+    lval *formals = f->formals;
+    lenv *env = lenv_copy(f->env);
+    *frame = NULL;
+
     /* Record Argument Counts */
     int given = a->count;
-    int total = f->formals->count;
+    int total = formals->count;
+    int i = 0;
 
     /* while argument still remain to be processed */
-    while(a->count) {
+    for (int j = 0; j < a->count; j++) {
         /* If we've ran out of formal arguments to bind */
-        if (f->formals->count == 0) {
+        if (i == formals->count) {
             lval_del(a);
+            lenv_del(env);
             return lval_err(
                 "Function passed too many arguments. "
                 "Got %i, Expected %i.", given, total);
         }
 
-        /* Pop the first symbol from the formals */
-        lval *sym = lval_pop(f->formals, 0);
+        /* Take the next symbol from the formals */
+        lval *sym = formals->cell[i++];
 
         /* Special Case to deal with '&' */
-        if (strcmp(sym->sym, "&") == 0) {
+        if (sym->sym == lsym_amp) {
             /* Ensure '&' is followed by another symbol */
-            if (f->formals->count != 1) {
+            if (formals->count - i != 1) {
                 lval_del(a);
+                lenv_del(env);
                 return lval_err("Function format invalid. "
                                 "Symbol '&' not followed by single symbol.");
             }
 
             /* Next formal should be bound to remaining arguments */
-            lval *nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym);
-            lval_del(nsym);
+            lval *rest = builtin_list(e, lval_slice(lval_ref(a), j, a->count));
+            lenv_put(env, formals->cell[i++], rest);
+            lval_del(rest);
             break;
         }
 
-        /* Pop the next argment from the list */
-        lval *val = lval_pop(a, 0);
-
-        /* Bind a copy into the function's environment */
-        lenv_put(f->env, sym, val);
-        /* Delete symbol and value */
-        lval_del(sym);
-        lval_del(val);
+        /* Bind the argument into the new environment */
+        lenv_put(env, sym, a->cell[j]);
     }
 
     /* Argument list is now bound so can be cleaned up */
     lval_del(a);
 
     /* If '&' remains in formal list bind to empty list */
-    if (f->formals->count > 0
-        && strcmp(f->formals->cell[0]->sym, "&") == 0) {
+    if (i < formals->count && formals->cell[i]->sym == lsym_amp) {
         /* Check to ensure that & is not passed invalidly. */
-        if (f->formals->count != 2) {
+        if (formals->count - i != 2) {
+            lenv_del(env);
             return lval_err("Function format invalid. "
                             "Symbol '&' not followed by single symbol.");
         }
 
-        /* Pop and delete '&' symbol */
-        lval_del(lval_pop(f->formals, 0));
-
-        /* Pop next symbol and create empty list */
-        lval *sym = lval_pop(f->formals, 0);
+        /* Bind the symbol after '&' to an empty list */
         lval *val = lval_qexpr();
-
-        /* Bind to environment and delete */
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
+        lenv_put(env, formals->cell[i + 1], val);
         lval_del(val);
+        i += 2;
     }
 
-    /* If all formals have been bound evalute */
-    if (f->formals->count == 0) {
+    /* If all formals have been bound it is ready to evaluate */
+    if (i == formals->count) {
         /* Set environment parent to evaluation environment */
-        f->env->par = e;
+        env->par = e;
+        *frame = env;
+        return NULL;
+    }
 
-        /* Evaluate and return */
-        return builtin_eval(
-            f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    } else {
-        /* Otherwise return partially evaluated function */
-        return lval_copy(f);
+    /* Otherwise return partially evaluated function, which shares the
+       body and the rest of the formals */
+    lval *p = lval_alloc();
+    p->type = LVAL_FUN;
+    p->refs = 1;
+    p->builtin = NULL;
+    p->env = env;
+    p->formals = lval_slice(lval_ref(formals), i, formals->count);
+    p->body = lval_ref(f->body);
+
+    return p;
+}
+
+/* the operator of an arithmetic or comparison builtin f, or -1 */
+int lnum_op(lbuiltin f) {
+    if (f == builtin_add) {return LNUM_ADD;}
+    if (f == builtin_sub) {return LNUM_SUB;}
+    if (f == builtin_mul) {return LNUM_MUL;}
+    if (f == builtin_div) {return LNUM_DIV;}
+    if (f == builtin_gt) {return LNUM_GT;}
+    if (f == builtin_lt) {return LNUM_LT;}
+    if (f == builtin_ge) {return LNUM_GE;}
+    if (f == builtin_le) {return LNUM_LE;}
+    if (f == builtin_eq) {return LNUM_EQ;}
+    if (f == builtin_ne) {return LNUM_NE;}
+    return -1;
+}
+
+/* x op y for two longs, or NULL if the result does not fit in one */
+lval *lnum_binop(int op, long x, long y) {
+    long r;
+    switch (op) {
+    case LNUM_ADD:
+        return __builtin_add_overflow(x, y, &r) ? NULL : lval_num(r);
+    case LNUM_SUB:
+        return __builtin_sub_overflow(x, y, &r) ? NULL : lval_num(r);
+    case LNUM_MUL:
+        return __builtin_mul_overflow(x, y, &r) ? NULL : lval_num(r);
+    case LNUM_DIV:
+        if (y == 0) {return lval_err("Division By Zero!");}
+        return x == LONG_MIN && y == -1 ? NULL : lval_num(x / y);
+    case LNUM_GT: return lval_num(x > y);
+    case LNUM_LT: return lval_num(x < y);
+    case LNUM_GE: return lval_num(x >= y);
+    case LNUM_LE: return lval_num(x <= y);
+    case LNUM_EQ: return lval_num(x == y);
+    case LNUM_NE: return lval_num(x != y);
+    }
+    return lval_err("Unknown operator %i.", op);
+}
+
+/* x op y for two doubles */
+lval *lnum_dblop(int op, double x, double y) {
+    switch (op) {
+    case LNUM_ADD: return lval_dbl(x + y);
+    case LNUM_SUB: return lval_dbl(x - y);
+    case LNUM_MUL: return lval_dbl(x * y);
+    case LNUM_DIV: return lval_dbl(x / y);
+    case LNUM_GT: return lval_num(x > y);
+    case LNUM_LT: return lval_num(x < y);
+    case LNUM_GE: return lval_num(x >= y);
+    case LNUM_LE: return lval_num(x <= y);
+    case LNUM_EQ: return lval_num(x == y);
+    case LNUM_NE: return lval_num(x != y);
+    }
+    return lval_err("Unknown operator %i.", op);
+}
+
+/* x op y for numbers of any kind. Integers stay exact, becoming
+   bignums when they no longer fit in a long, and a double on either
+   side makes the result a double. */
+lval *lnum_arith(int op, lval *x, lval *y) {
+    int tx = lval_type(x);
+    int ty = lval_type(y);
+
+    if (tx == LVAL_NUM && ty == LVAL_NUM) {
+        lval *r = lnum_binop(op, lval_to_num(x), lval_to_num(y));
+        if (r) {return r;}
+    } else if (op == LNUM_DIV && ty == LVAL_NUM && lval_to_num(y) == 0) {
+        return lval_err("Division By Zero!");
+    } else if (tx == LVAL_DBL || ty == LVAL_DBL) {
+        return lnum_dblop(op, lnum_to_dbl(x), lnum_to_dbl(y));
+    }
+
+    return lbig_binop(op, x, y);
+}
+
+int lnum_is(lval *v) {
+    int t = lval_type(v);
+    return t == LVAL_NUM || t == LVAL_DBL || t == LVAL_BIG;
+}
+
+double lnum_to_dbl(lval *v) {
+    switch (lval_type(v)) {
+    case LVAL_NUM: return lval_to_num(v);
+    case LVAL_BIG: return lbig_to_dbl(v);
+    default: return lval_to_dbl(v);
+    }
+}
+
+/* Bignums. Digits are 32 bits so that the product of two, plus two
+   more, fits in a uint64_t. Every integer that fits in a long is an
+   LVAL_NUM rather than an LVAL_BIG (see lbig_norm), so equal integers
+   are always of the same kind, and operations on two longs only come
+   here when their result does not fit in one. */
+
+/* a bignum of 'len' zero digits, to be passed through lbig_norm */
+lval *lbig_new(int len) {
+    lval *v = lval_alloc();
+    v->type = LVAL_BIG;
+    v->refs = 1;
+    v->bneg = 0;
+    v->blen = len;
+    v->big = calloc(len ? len : 1, sizeof(uint32_t));
+
+    return v;
+}
+
+/* drop the leading zero digits of bignum v, and turn it into a long if
+   it fits in one */
+lval *lbig_norm(lval *v) {
+    while (v->blen && v->big[v->blen - 1] == 0) {v->blen--;}
+    if ((size_t)v->blen * sizeof(uint32_t) > sizeof(unsigned long)) {
+        return v;
     }
+
+    unsigned long m = 0;
+    for (int i = v->blen - 1; i >= 0; i--) {
+        m = (m << 16 << 16) | v->big[i];
+    }
+    if (m > (unsigned long)LONG_MAX + v->bneg) {return v;}
+
+    long x = v->bneg ? -(long)(m - 1) - 1 : (long)m;
+    lval_del(v);
+    return lval_num(x);
+}
+
+/* integer v as a bignum, which may have leading zero digits */
+lval *lbig_of(lval *v) {
+    if (lval_type(v) == LVAL_BIG) {return lval_ref(v);}
+
+    long x = lval_to_num(v);
+    unsigned long m = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+    lval *b = lbig_new(sizeof(long) / sizeof(uint32_t));
+    b->bneg = x < 0;
+    for (int i = 0; m; i++) {
+        b->big[i] = (uint32_t)m;
+        m = m >> 16 >> 16;
+    }
+
+    return b;
+}
+
+/* compare the magnitudes of bignums x and y: -1, 0 or 1 */
+int lbig_cmpmag(lval *x, lval *y) {
+    int nx = x->blen;
+    int ny = y->blen;
+    while (nx && x->big[nx - 1] == 0) {nx--;}
+    while (ny && y->big[ny - 1] == 0) {ny--;}
+    if (nx != ny) {return nx < ny ? -1 : 1;}
+
+    for (int i = nx - 1; i >= 0; i--) {
+        if (x->big[i] != y->big[i]) {return x->big[i] < y->big[i] ? -1 : 1;}
+    }
+    return 0;
+}
+
+int lbig_cmp(lval *x, lval *y) {
+    int c = lbig_cmpmag(x, y);
+    if (c == 0) {return 0;}/* zero has no sign to compare */
+    if (x->bneg != y->bneg) {return x->bneg ? -1 : 1;}
+    return x->bneg ? -c : c;
+}
+
+/* |x| + |y| with sign 'neg' */
+lval *lbig_addmag(lval *x, lval *y, int neg) {
+    if (x->blen < y->blen) {
+        lval *t = x;
+        x = y;
+        y = t;
+    }
+
+    lval *r = lbig_new(x->blen + 1);
+    r->bneg = neg;
+    uint64_t c = 0;
+    for (int i = 0; i < x->blen; i++) {
+        c += (uint64_t)x->big[i] + (i < y->blen ? y->big[i] : 0);
+        r->big[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    r->big[x->blen] = (uint32_t)c;
+
+    return lbig_norm(r);
+}
+
+/* |x| - |y| with sign 'neg', where |x| >= |y| */
+lval *lbig_submag(lval *x, lval *y, int neg) {
+    lval *r = lbig_new(x->blen);
+    r->bneg = neg;
+    int64_t c = 0;
+    for (int i = 0; i < x->blen; i++) {
+        c += (int64_t)x->big[i] - (i < y->blen ? y->big[i] : 0);
+        r->big[i] = (uint32_t)c;
+        c = c < 0 ? -1 : 0;
+    }
+
+    return lbig_norm(r);
+}
+
+/* x + y, with y taken as negative if 'yneg' */
+lval *lbig_add(lval *x, lval *y, int yneg) {
+    if (x->bneg == yneg) {return lbig_addmag(x, y, yneg);}
+    if (lbig_cmpmag(x, y) >= 0) {return lbig_submag(x, y, x->bneg);}
+    return lbig_submag(y, x, yneg);
+}
+
+lval *lbig_mul(lval *x, lval *y) {
+    lval *r = lbig_new(x->blen + y->blen);
+    r->bneg = x->bneg != y->bneg;
+    for (int i = 0; i < x->blen; i++) {
+        uint64_t c = 0;
+        for (int j = 0; j < y->blen; j++) {
+            c += (uint64_t)x->big[i] * y->big[j] + r->big[i + j];
+            r->big[i + j] = (uint32_t)c;
+            c >>= 32;
+        }
+        r->big[i + y->blen] = (uint32_t)c;
+    }
+
+    return lbig_norm(r);
+}
+
+/* x / y rounded towards zero, y not zero. Long division as in Knuth's
+   algorithm D: each quotient digit is estimated from the top digits,
+   with y shifted so its top digit has its high bit set, which makes
+   the estimate at most two too large. */
+lval *lbig_div(lval *x, lval *y) {
+    int n = y->blen;
+    while (y->big[n - 1] == 0) {n--;}
+    int m = x->blen;
+    while (m && x->big[m - 1] == 0) {m--;}
+
+    lval *q = lbig_new(m >= n ? m - n + 1 : 1);
+    q->bneg = x->bneg != y->bneg;
+    if (m < n) {return lbig_norm(q);}
+
+    if (n == 1) {
+        uint64_t rem = 0;
+        for (int i = m - 1; i >= 0; i--) {
+            rem = rem << 32 | x->big[i];
+            q->big[i] = (uint32_t)(rem / y->big[0]);
+            rem %= y->big[0];
+        }
+        return lbig_norm(q);
+    }
+
+    /* normalize: u = x << s, v = y << s */
+    int s = __builtin_clz(y->big[n - 1]);
+    uint32_t *u = malloc(sizeof(uint32_t) * (m + 1));
+    uint32_t *v = malloc(sizeof(uint32_t) * n);
+    for (int i = n - 1; i > 0; i--) {
+        v[i] = y->big[i] << s | (s ? y->big[i - 1] >> (32 - s) : 0);
+    }
+    v[0] = y->big[0] << s;
+    u[m] = s ? x->big[m - 1] >> (32 - s) : 0;
+    for (int i = m - 1; i > 0; i--) {
+        u[i] = x->big[i] << s | (s ? x->big[i - 1] >> (32 - s) : 0);
+    }
+    u[0] = x->big[0] << s;
+
+    for (int j = m - n; j >= 0; j--) {
+        /* estimate the digit, and correct it from the next digit */
+        uint64_t top = (uint64_t)u[j + n] << 32 | u[j + n - 1];
+        uint64_t qhat = top / v[n - 1];
+        uint64_t rhat = top % v[n - 1];
+        while (qhat >> 32
+               || qhat * v[n - 2] > (rhat << 32 | u[j + n - 2])) {
+            qhat--;
+            rhat += v[n - 1];
+            if (rhat >> 32) {break;}
+        }
+
+        /* subtract qhat * v from u */
+        int64_t t;
+        int64_t k = 0;
+        for (int i = 0; i < n; i++) {
+            uint64_t p = qhat * v[i];
+            t = (int64_t)u[i + j] - k - (int64_t)(p & 0xffffffff);
+            u[i + j] = (uint32_t)t;
+            k = (int64_t)(p >> 32) - (t >> 32);
+        }
+        t = (int64_t)u[j + n] - k;
+        u[j + n] = (uint32_t)t;
+
+        /* it went negative, so qhat was one too large: add v back */
+        if (t < 0) {
+            qhat--;
+            uint64_t c = 0;
+            for (int i = 0; i < n; i++) {
+                c += (uint64_t)u[i + j] + v[i];
+                u[i + j] = (uint32_t)c;
+                c >>= 32;
+            }
+            u[j + n] += (uint32_t)c;
+        }
+        q->big[j] = (uint32_t)qhat;
+    }
+
+    free(u);
+    free(v);
+    return lbig_norm(q);
+}
+
+/* x op y for integers of which at least one is a bignum, or whose
+   result does not fit in a long */
+lval *lbig_binop(int op, lval *x, lval *y) {
+    lval *a = lbig_of(x);
+    lval *b = lbig_of(y);
+    lval *r;
+
+    switch (op) {
+    case LNUM_ADD: r = lbig_add(a, b, b->bneg); break;
+    case LNUM_SUB: r = lbig_add(a, b, !b->bneg); break;
+    case LNUM_MUL: r = lbig_mul(a, b); break;
+    case LNUM_DIV:
+        /* lnum_arith has rejected a zero divisor, and a bignum is never 0 */
+        r = lbig_div(a, b);
+        break;
+    default:
+        /* compare how the two compare with 0 */
+        r = lnum_binop(op, lbig_cmp(a, b), 0);
+        break;
+    }
+
+    lval_del(a);
+    lval_del(b);
+    return r;
+}
+
+double lbig_to_dbl(lval *v) {
+    double x = 0;
+    for (int i = v->blen - 1; i >= 0; i--) {
+        x = x * 4294967296.0 + v->big[i];
+    }
+    return v->bneg ? -x : x;
+}
+
+/* the integer of the decimal digits from s to end, negated if 'neg' */
+lval *lbig_read(char *s, char *end, int neg) {
+    /* nine digits at a time, each less than 2^30 */
+    lval *v = lbig_new((end - s) / 9 + 1);
+    v->bneg = neg;
+    int len = 0;
+    while (s < end) {
+        uint32_t d = 0;
+        uint32_t scale = 1;
+        for (int i = 0; i < 9 && s < end; i++, s++) {
+            d = d * 10 + (*s - '0');
+            scale *= 10;
+        }
+
+        uint64_t c = d;
+        for (int i = 0; i < len; i++) {
+            c += (uint64_t)v->big[i] * scale;
+            v->big[i] = (uint32_t)c;
+            c >>= 32;
+        }
+        if (c) {v->big[len++] = (uint32_t)c;}
+    }
+
+    return lbig_norm(v);
 }
 
-lval *builtin_op(lenv *e, lval *a, char *op) {
+/* print bignum v in decimal, nine digits at a time */
+void lbig_print(lval *v) {
+    uint32_t *m = malloc(sizeof(uint32_t) * v->blen);
+    uint32_t *parts = malloc(sizeof(uint32_t) * (v->blen * 32 / 29 + 1));
+    memcpy(m, v->big, sizeof(uint32_t) * v->blen);
+
+    /* divide by 10^9 until nothing is left, keeping the remainders */
+    int n = 0;
+    int len = v->blen;
+    while (len) {
+        uint64_t rem = 0;
+        for (int i = len - 1; i >= 0; i--) {
+            rem = rem << 32 | m[i];
+            m[i] = (uint32_t)(rem / 1000000000);
+            rem %= 1000000000;
+        }
+        parts[n++] = (uint32_t)rem;
+        while (len && m[len - 1] == 0) {len--;}
+    }
+
+    printf("%s%u", v->bneg ? "-" : "", n ? parts[n - 1] : 0);
+    for (int i = n - 2; i >= 0; i--) {printf("%09u", parts[i]);}
+
+    free(m);
+    free(parts);
+}
+
+lval *builtin_op(lenv *e, lval *a, int op) {
     /* ensure all arguments are numbers */
     for (int i = 0; i < a->count; i++) {
-        LASSERT_TYPE(op, a, i, LVAL_NUM);
+        LASSERT_IS_NUM(lnum_names[op], a, i);
     }
 
-    /* pop the first element */
-    lval *x = lval_pop(a, 0);
+    lval **v = a->cell;
+    int n = a->count;
 
-    /* if no arguments and sub the preform unary negation */
-    if (strcmp(op, "-") == 0 && a->count == 0) {
-        x->num = -x->num;
+    /* the common case of two arguments */
+    if (n == 2) {
+        lval *x = lnum_arith(op, v[0], v[1]);
+        lval_del(a);
+        return x;
     }
 
-    /* while there are still elements remaining */
-    while(a->count > 0) {
-        /* pop the next element */
-        lval *y = lval_pop(a, 0);
-
-        if(strcmp(op, "+") == 0) {x->num += y->num;}
-        if(strcmp(op, "-") == 0) {x->num -= y->num;}
-        if(strcmp(op, "*") == 0) {x->num *= y->num;}
-        if(strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("Division By Zero!");
+    /* integers are folded in a long for as long as they and the
+       result fit in one, with a loop for each operator */
+    long x = 0;
+    int i = 1;
+    if (lval_type(v[0]) == LVAL_NUM) {
+        x = lval_to_num(v[0]);
+        long r;
+        switch (op) {
+        case LNUM_ADD:
+            for (; i < n && lval_type(v[i]) == LVAL_NUM; i++) {
+                if (__builtin_add_overflow(x, lval_to_num(v[i]), &r)) {
+                    break;
+                }
+                x = r;
+            }
+            break;
+        case LNUM_SUB:
+            for (; i < n && lval_type(v[i]) == LVAL_NUM; i++) {
+                if (__builtin_sub_overflow(x, lval_to_num(v[i]), &r)) {
+                    break;
+                }
+                x = r;
+            }
+            break;
+        case LNUM_MUL:
+            for (; i < n && lval_type(v[i]) == LVAL_NUM; i++) {
+                if (__builtin_mul_overflow(x, lval_to_num(v[i]), &r)) {
+                    break;
+                }
+                x = r;
+            }
+            break;
+        case LNUM_DIV:
+            for (; i < n && lval_type(v[i]) == LVAL_NUM; i++) {
+                long y = lval_to_num(v[i]);
+                if (y == 0) {
+                    lval_del(a);
+                    return lval_err("Division By Zero!");
+                }
+                if (x == LONG_MIN && y == -1) {break;}
+                x /= y;
             }
-            x->num /= y->num;
+            break;
         }
-        lval_del(y);
+    }
+
+    /* the rest one at a time, promoting as needed */
+    lval *acc = lval_type(v[0]) == LVAL_NUM ? lval_num(x) : lval_ref(v[0]);
+
+    /* a single argument is negated */
+    if (op == LNUM_SUB && n == 1) {
+        lval *r = lnum_arith(LNUM_MUL, acc, lval_num(-1));
+        lval_del(acc);
+        acc = r;
+    }
+    for (; i < n && lval_type(acc) != LVAL_ERR; i++) {
+        lval *r = lnum_arith(op, acc, v[i]);
+        lval_del(acc);
+        acc = r;
     }
 
     lval_del(a);
-    return x;
+    return acc;
 }
 
 lval *builtin_def(lenv *e, lval *a) {
@@ -847,10 +2799,10 @@ lval *builtin_var(lenv *e, lval *a, char *func) {
 
     lval *syms = a->cell[0];
     for (int i = 0; i < syms->count; i++) {
-        LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+        LASSERT(a, (lval_type(syms->cell[i]) == LVAL_SYM),
                 "Function '%s' cannot define non-symbol. "
                 "Got %s, Expected %s.", func,
-                ltype_name(syms->cell[i]->type),
+                ltype_name(lval_type(syms->cell[i])),
                 ltype_name(LVAL_SYM));
     }
 
@@ -858,13 +2810,13 @@ lval *builtin_var(lenv *e, lval *a, char *func) {
             "Function '%s' passed too many arguments for symbols. "
             "Got %i, Expected %i.", func, syms->count, a->count-1);
 
-    for (int i = 0; i < syms->count; i++) {
-        /* If 'def' define in globally. If 'put' define in locally*/
-        if (strcmp(func, "def") == 0) {
+    /* If 'def' define in globally. If 'put' define in locally*/
+    if (strcmp(func, "def") == 0) {
+        for (int i = 0; i < syms->count; i++) {
             lenv_def(e, syms->cell[i], a->cell[i+1]);
         }
-
-        if (strcmp(func, "=") == 0) {
+    } else {
+        for (int i = 0; i < syms->count; i++) {
             lenv_put(e, syms->cell[i], a->cell[i+1]);
         }
     }
@@ -882,9 +2834,9 @@ lval *builtin_lambda(lenv *e, lval *a) {
 
     /* check first Q-Expression contains only Symbols */
     for (int i = 0; i < a->cell[0]->count; i++) {
-        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+        LASSERT(a, (lval_type(a->cell[0]->cell[i]) == LVAL_SYM),
                 "Cannot define non-symbol. Got %s, Expected %s.",
-                ltype_name(a->cell[0]->cell[i]->type),
+                ltype_name(lval_type(a->cell[0]->cell[i])),
                 ltype_name(LVAL_SYM));
     }
 
@@ -896,73 +2848,54 @@ lval *builtin_lambda(lenv *e, lval *a) {
     return lval_lambda(formals, body);
 }
 
-lval *builtin_ord(lenv *e, lval *a, char *op)
+lval *builtin_ord(lenv *e, lval *a, int op)
 {
-    LASSERT_NUM(op, a, 2);
-    LASSERT_TYPE(op, a, 0, LVAL_NUM);
-    LASSERT_TYPE(op, a, 1, LVAL_NUM);
-
-    int r;
-    if (strcmp(op, ">") == 0) {
-        r = (a->cell[0]->num > a->cell[1]->num);
-    }
-    if (strcmp(op, "<") == 0) {
-        r = (a->cell[0]->num < a->cell[1]->num);
-    }
-    if (strcmp(op, ">=") == 0) {
-        r = (a->cell[0]->num >= a->cell[1]->num);
-    }
-    if (strcmp(op, "<=") == 0) {
-        r = (a->cell[0]->num <= a->cell[1]->num);
-    }
+    LASSERT_NUM(lnum_names[op], a, 2);
+    LASSERT_IS_NUM(lnum_names[op], a, 0);
+    LASSERT_IS_NUM(lnum_names[op], a, 1);
 
+    lval *r = lnum_arith(op, a->cell[0], a->cell[1]);
     lval_del(a);
-    return lval_num(r);
+    return r;
 }
 
 lval *builtin_gt(lenv *e, lval *a)
 {
-    return builtin_ord(e, a, ">");
+    return builtin_ord(e, a, LNUM_GT);
 }
 
 lval *builtin_lt(lenv *e, lval *a)
 {
-    return builtin_ord(e, a, "<");
+    return builtin_ord(e, a, LNUM_LT);
 }
 
 lval *builtin_ge(lenv *e, lval *a)
 {
-    return builtin_ord(e, a, ">=");
+    return builtin_ord(e, a, LNUM_GE);
 }
 
 lval *builtin_le(lenv *e, lval *a)
 {
-    return builtin_ord(e, a, "<=");
+    return builtin_ord(e, a, LNUM_LE);
 }
 
-lval *builtin_cmp(lenv *e, lval *a, char *op)
+lval *builtin_cmp(lenv *e, lval *a, int op)
 {
-    LASSERT_NUM(op, a, 2);
+    LASSERT_NUM(lnum_names[op], a, 2);
 
-    int r;
-    if (strcmp(op, "==")  == 0) {
-        r = lval_eq(a->cell[0], a->cell[1]);
-    }
-    if (strcmp(op, "!=")  == 0) {
-        r = !lval_eq(a->cell[0], a->cell[1]);
-    }
+    int r = lval_eq(a->cell[0], a->cell[1]);
     lval_del(a);
-    return lval_num(r);
+    return lval_num(op == LNUM_EQ ? r : !r);
 }
 
 lval *builtin_eq(lenv *e, lval *a)
 {
-    return builtin_cmp(e, a, "==");
+    return builtin_cmp(e, a, LNUM_EQ);
 }
 
 lval *builtin_ne(lenv *e, lval *a)
 {
-    return builtin_cmp(e, a, "!=");
+    return builtin_cmp(e, a, LNUM_NE);
 }
 
 lval *builtin_if(lenv *e, lval *a)
@@ -972,348 +2905,2391 @@ lval *builtin_if(lenv *e, lval *a)
     LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
     LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
 
-    /*Mark Both Expressions as evaluable*/
-    lval *x;
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
-
-    if (a->cell[0]->num) {
-        /*if conditions is true evaluate first Expression*/
-        x = lval_eval(e, lval_pop(a, 1));
-    } else {
-        /*otherwise evaluate second Expression*/
-        x = lval_eval(e, lval_pop(a, 2));
-    }
+    /*if conditions is true evaluate first Expression
+      otherwise evaluate second Expression*/
+    lval *x = lval_eval_sexpr(e, a->cell[lval_to_num(a->cell[0]) ? 1 : 2]);
 
     /*Delete argument list and return*/
     lval_del(a);
     return x;
 }
 
-lval *builtin_print(lenv *e, lval *a) {
-    /* Print each argument followed by a space */
+/* (select {cond value} ...) evaluates the value of the first clause
+   whose condition holds, evaluating no more than it needs to */
+lval *builtin_select(lenv *e, lval *a) {
     for (int i = 0; i < a->count; i++) {
-        lval_print(a->cell[i]); putchar(' ');
+        LASSERT_TYPE("select", a, i, LVAL_QEXPR);
+        LASSERT(a, a->cell[i]->count >= 2,
+                "Function 'select' passed clause %i without a value.", i);
     }
 
-    /* Print a newline and delete arguments */
-    putchar('\n');
-    lval_del(a);
-
-    return lval_sexpr();
-}
-
-lval *builtin_error(lenv *e, lval *a) {
-    LASSERT_NUM("error", a, 1);
-    LASSERT_TYPE("error", a, 0, LVAL_STR);
+    for (int i = 0; i < a->count; i++) {
+        lval *c = lval_eval(e, a->cell[i]->cell[0]);
+        if (lval_type(c) != LVAL_NUM) {
+            lval *err = c;
+            if (lval_type(c) != LVAL_ERR) {
+                err = lval_err("Function 'select' passed incorrect type "
+                               "for condition %i. Got %s, Expected %s.",
+                               i, ltype_name(lval_type(c)),
+                               ltype_name(LVAL_NUM));
+                lval_del(c);
+            }
+            lval_del(a);
+            return err;
+        }
 
-    /* Construct Error from first argument */
-    lval *err = lval_err(a->cell[0]->str);
+        long holds = lval_to_num(c);
+        lval_del(c);
+        if (holds) {
+            lval *x = lval_eval(e, a->cell[i]->cell[1]);
+            lval_del(a);
+            return x;
+        }
+    }
 
-    /* Delete arguments and return */
     lval_del(a);
-
-    return err;
+    return lval_err("No Selection Found");
 }
 
-lval *builtin_head(lenv *e, lval *a) {
-    /* check error conditions */
-    LASSERT_NUM("head", a, 1);
+/* (case x {key value} ...) evaluates the value of the first clause
+   whose key evaluates equal to x */
+lval *builtin_case(lenv *e, lval *a) {
+    LASSERT(a, a->count > 0, "Function 'case' passed no arguments.");
+    for (int i = 1; i < a->count; i++) {
+        LASSERT_TYPE("case", a, i, LVAL_QEXPR);
+        LASSERT(a, a->cell[i]->count >= 2,
+                "Function 'case' passed clause %i without a value.", i);
+    }
+
+    for (int i = 1; i < a->count; i++) {
+        lval *k = lval_eval(e, a->cell[i]->cell[0]);
+        if (lval_type(k) == LVAL_ERR) {
+            lval_del(a);
+            return k;
+        }
+
+        int match = lval_eq(a->cell[0], k);
+        lval_del(k);
+        if (match) {
+            lval *x = lval_eval(e, a->cell[i]->cell[1]);
+            lval_del(a);
+            return x;
+        }
+    }
+
+    lval_del(a);
+    return lval_err("No Case Found");
+}
+
+/* (do a b c) gives c: its arguments have been evaluated in order */
+lval *builtin_do(lenv *e, lval *a) {
+    if (a->count == 0) {
+        lval_del(a);
+        return lval_qexpr();
+    }
+
+    return lval_take(a, a->count - 1);
+}
+
+/* (let {body}) evaluates body in a new scope */
+lval *builtin_let(lenv *e, lval *a) {
+    LASSERT_NUM("let", a, 1);
+    LASSERT_TYPE("let", a, 0, LVAL_QEXPR);
+
+    lenv *scope = lenv_new();
+    scope->par = e;
+    lval *x = lval_eval_sexpr(scope, a->cell[0]);
+    lenv_del(scope);
+    lval_del(a);
+
+    return x;
+}
+
+/* (fun {name formals...} {body}) defines a function globally */
+lval *builtin_fun(lenv *e, lval *a) {
+    LASSERT_NUM("fun", a, 2);
+    LASSERT_TYPE("fun", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("fun", a, 1, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY("fun", a, 0);
+
+    for (int i = 0; i < a->cell[0]->count; i++) {
+        LASSERT(a, (lval_type(a->cell[0]->cell[i]) == LVAL_SYM),
+                "Cannot define non-symbol. Got %s, Expected %s.",
+                ltype_name(lval_type(a->cell[0]->cell[i])),
+                ltype_name(LVAL_SYM));
+    }
+
+    /* the formals are the rest of the first list */
+    lval *f = lval_pop(a, 0);
+    lval *name = lval_ref(f->cell[0]);
+    lval *fn = lval_lambda(lval_slice(f, 1, f->count), lval_pop(a, 0));
+    lenv_def(e, name, fn);
+
+    lval_del(name);
+    lval_del(fn);
+    lval_del(a);
+
+    return lval_sexpr();
+}
+
+lval *builtin_print(lenv *e, lval *a) {
+    /* Print each argument followed by a space */
+    for (int i = 0; i < a->count; i++) {
+        lval_print(a->cell[i]); putchar(' ');
+    }
+
+    /* Print a newline and delete arguments */
+    putchar('\n');
+    lval_del(a);
+
+    return lval_sexpr();
+}
+
+/* percentage of allocations from pools [first, last) served by reusing
+   a freed block */
+long lalloc_hit_pct(int first, int last) {
+    long allocs = 0, hits = 0;
+    for (int i = first; i < last; i++) {
+        allocs += lalloc.pools[i].allocs;
+        hits += lalloc.pools[i].hits;
+    }
+
+    return allocs ? hits * 100 / allocs : 0;
+}
+
+/* look up a runtime statistic by name, -1 if there is no such stat */
+long lgc_stat(char *name) {
+    if (strcmp(name, "collections") == 0)     {return lgc.collections;}
+    if (strcmp(name, "objects") == 0)         {return lgc.objects;}
+    if (strcmp(name, "freed") == 0)           {return lgc.freed;}
+    if (strcmp(name, "bytes-live") == 0)      {return lgc.live_bytes;}
+    if (strcmp(name, "bytes-allocated") == 0) {return lgc.allocated;}
+    if (strcmp(name, "heap-step") == 0)       {return LGC_HEAP_STEP;}
+    if (strcmp(name, "pause-last-us") == 0)   {return lgc.last_pause;}
+    if (strcmp(name, "pause-max-us") == 0)    {return lgc.max_pause;}
+    if (strcmp(name, "pause-total-us") == 0)  {return lgc.total_pause;}
+
+    /* the peak resident size of the whole process, in kilobytes on
+       Linux (the BSDs and macOS count bytes) */
+    if (strcmp(name, "rss-peak-kb") == 0) {
+        struct rusage ru;
+        return getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0;
+    }
+
+    int ncells = LPOOL_CELLS + LCELL_CLASSES;
+    if (strcmp(name, "lval-hit-pct") == 0)
+        {return lalloc_hit_pct(LPOOL_VAL, LPOOL_VAL + 1);}
+    if (strcmp(name, "lenv-hit-pct") == 0)
+        {return lalloc_hit_pct(LPOOL_ENV, LPOOL_ENV + 1);}
+    if (strcmp(name, "cells-hit-pct") == 0)
+        {return lalloc_hit_pct(LPOOL_CELLS, ncells);}
+    if (strcmp(name, "cells-large") == 0)     {return lalloc.large;}
+    if (strcmp(name, "ic-hits") == 0)         {return lic.hits;}
+    if (strcmp(name, "ic-misses") == 0)       {return lic.misses;}
+    if (strcmp(name, "lval-allocs") == 0)
+        {return lalloc.pools[LPOOL_VAL].allocs;}
+    if (strcmp(name, "slabs") == 0) {
+        long slabs = 0;
+        for (int i = 0; i < ncells; i++) {slabs += lalloc.pools[i].slabs;}
+        return slabs;
+    }
+
+    return -1;
+}
+
+/* (gc-stats {collections pause-max-us}) gives the values of the named
+   statistics, (gc-stats {}) a list of {"name" value} pairs of all */
+lval *builtin_gc_stats(lenv *e, lval *a) {
+    static char *names[] = {
+        "collections", "objects", "freed", "bytes-live", "bytes-allocated",
+        "heap-step", "pause-last-us", "pause-max-us", "pause-total-us",
+        "lval-allocs", "lval-hit-pct", "lenv-hit-pct", "cells-hit-pct",
+        "cells-large", "slabs", "ic-hits", "ic-misses", "rss-peak-kb",
+    };
+
+    LASSERT_NUM("gc-stats", a, 1);
+    LASSERT_TYPE("gc-stats", a, 0, LVAL_QEXPR);
+
+    lval *q = a->cell[0];
+    for (int i = 0; i < q->count; i++) {
+        LASSERT(a, lval_type(q->cell[i]) == LVAL_SYM
+                && lgc_stat(q->cell[i]->sym) >= 0,
+                "Function 'gc-stats' passed unknown statistic.");
+    }
+
+    lval *v = lval_qexpr();
+    if (q->count == 0) {
+        for (int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            lval *pair = lval_add(lval_qexpr(), lval_str(names[i]));
+            v = lval_add(v, lval_add(pair, lval_num(lgc_stat(names[i]))));
+        }
+    }
+    for (int i = 0; i < q->count; i++) {
+        v = lval_add(v, lval_num(lgc_stat(q->cell[i]->sym)));
+    }
+
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_error(lenv *e, lval *a) {
+    LASSERT_NUM("error", a, 1);
+    LASSERT_TYPE("error", a, 0, LVAL_STR);
+
+    /* Construct Error from first argument */
+    lval *err = lval_err(a->cell[0]->str);
+
+    /* Delete arguments and return */
+    lval_del(a);
+
+    return err;
+}
+
+/* String library. Strings carry their length, so none of these scan
+   for the NUL, and each builds its result with a single allocation. A
+   builder is the one mutable value: (str-add b ...) appends to b in
+   place, for building a string piece by piece in linear time, and
+   (str-build b) gives the string built so far. */
+
+lval *builtin_str_len(lenv *e, lval *a) {
+    LASSERT_NUM("str-len", a, 1);
+    LASSERT_TYPE("str-len", a, 0, LVAL_STR);
+
+    long n = a->cell[0]->slen;
+    lval_del(a);
+    return lval_num(n);
+}
+
+/* (substr start end s) gives the bytes [start, end) of s */
+lval *builtin_substr(lenv *e, lval *a) {
+    LASSERT_NUM("substr", a, 3);
+    LASSERT_TYPE("substr", a, 0, LVAL_NUM);
+    LASSERT_TYPE("substr", a, 1, LVAL_NUM);
+    LASSERT_TYPE("substr", a, 2, LVAL_STR);
+
+    long start = lval_to_num(a->cell[0]);
+    long end = lval_to_num(a->cell[1]);
+    lval *s = a->cell[2];
+    LASSERT(a, start >= 0 && start <= end && end <= s->slen,
+            "Function 'substr' passed range %li to %li out of range.",
+            start, end);
+
+    lval *x = lval_strn(s->str + start, end - start);
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_str_concat(lenv *e, lval *a) {
+    long n = 0;
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE("str-concat", a, i, LVAL_STR);
+        n += a->cell[i]->slen;
+    }
+
+    lval *x = lval_strn("", 0);
+    if (n >= LSTR_SMALL) {x->str = malloc(n + 1);}
+    for (int i = 0; i < a->count; i++) {
+        memcpy(x->str + x->slen, a->cell[i]->str, a->cell[i]->slen);
+        x->slen += a->cell[i]->slen;
+    }
+    x->str[n] = '\0';
+
+    lval_del(a);
+    return x;
+}
+
+/* (str-join sep {s ...}) gives the strings s joined by sep */
+lval *builtin_str_join(lenv *e, lval *a) {
+    LASSERT_NUM("str-join", a, 2);
+    LASSERT_TYPE("str-join", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-join", a, 1, LVAL_QEXPR);
+
+    lval *sep = a->cell[0];
+    lval *q = a->cell[1];
+    long n = 0;
+    for (int i = 0; i < q->count; i++) {
+        LASSERT(a, lval_type(q->cell[i]) == LVAL_STR,
+                "Function 'str-join' passed incorrect type for item %i. "
+                "Got %s, Expected %s.", i,
+                ltype_name(lval_type(q->cell[i])), ltype_name(LVAL_STR));
+        n += q->cell[i]->slen + (i ? sep->slen : 0);
+    }
+
+    lval *x = lval_strn("", 0);
+    if (n >= LSTR_SMALL) {x->str = malloc(n + 1);}
+    for (int i = 0; i < q->count; i++) {
+        if (i) {
+            memcpy(x->str + x->slen, sep->str, sep->slen);
+            x->slen += sep->slen;
+        }
+        memcpy(x->str + x->slen, q->cell[i]->str, q->cell[i]->slen);
+        x->slen += q->cell[i]->slen;
+    }
+    x->str[n] = '\0';
+
+    lval_del(a);
+    return x;
+}
+
+/* (str-split sep s) gives the pieces of s between the occurrences of
+   sep, so that str-join puts them back together */
+lval *builtin_str_split(lenv *e, lval *a) {
+    LASSERT_NUM("str-split", a, 2);
+    LASSERT_TYPE("str-split", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-split", a, 1, LVAL_STR);
+
+    lval *sep = a->cell[0];
+    lval *s = a->cell[1];
+    LASSERT(a, sep->slen > 0, "Function 'str-split' passed an empty "
+            "separator.");
+
+    lval *x = lval_qexpr();
+    char *p = s->str;
+    char *end = s->str + s->slen;
+    for (;;) {
+        /* the next occurrence of sep, found by its first byte */
+        char *q = p;
+        while ((q = memchr(q, sep->str[0], end - q))
+               && (end - q < sep->slen
+                   || memcmp(q, sep->str, sep->slen) != 0)) {
+            q++;
+        }
+        if (!q) {break;}
+        lval_add(x, lval_strn(p, q - p));
+        p = q + sep->slen;
+    }
+    lval_add(x, lval_strn(p, end - p));
+
+    lval_del(a);
+    return x;
+}
+
+/* (str-builder s ...) gives a new builder holding the strings s. As
+   (str-builder) is the builtin itself, (str-builder "") starts empty. */
+lval *builtin_str_builder(lenv *e, lval *a) {
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE("str-builder", a, i, LVAL_STR);
+    }
+
+    lval *b = lval_builder();
+    for (int i = 0; i < a->count; i++) {
+        lstr_add(b, a->cell[i]->str, a->cell[i]->slen);
+    }
+
+    lval_del(a);
+    return b;
+}
+
+/* (str-add b s ...) appends the strings s to builder b, and gives b */
+lval *builtin_str_add(lenv *e, lval *a) {
+    LASSERT(a, a->count > 0, "Function 'str-add' passed no arguments.");
+    LASSERT_TYPE("str-add", a, 0, LVAL_BUILDER);
+    for (int i = 1; i < a->count; i++) {
+        LASSERT_TYPE("str-add", a, i, LVAL_STR);
+    }
+
+    lval *b = a->cell[0];
+    for (int i = 1; i < a->count; i++) {
+        lstr_add(b, a->cell[i]->str, a->cell[i]->slen);
+    }
+
+    return lval_take(a, 0);
+}
+
+lval *builtin_str_build(lenv *e, lval *a) {
+    LASSERT_NUM("str-build", a, 1);
+    LASSERT_TYPE("str-build", a, 0, LVAL_BUILDER);
+
+    lval *x = lval_strn(a->cell[0]->str, a->cell[0]->slen);
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_head(lenv *e, lval *a) {
+    /* check error conditions */
+    LASSERT_NUM("head", a, 1);
     LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
     LASSERT_NOT_EMPTY("head", a, 0);
 
-    /* otherwise take first argument */
-    lval *v = lval_take(a, 0);
+    /* otherwise take first argument */
+    lval *v = lval_take(a, 0);
+
+    /* build a new list from its first element */
+    lval *x = lval_add(lval_qexpr(), lval_ref(v->cell[0]));
+    lval_del(v);
+
+    return x;
+}
+lval *builtin_tail(lenv *e, lval *a) {
+    /* check error conditions */
+    LASSERT_NUM("tail", a, 1);
+    LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY("tail", a, 0);
+
+    /* take first argument and return a view of all but its first item */
+    lval *v = lval_take(a, 0);
+
+    return lval_slice(v, 1, v->count);
+}
+
+lval *builtin_list(lenv *e, lval *a) {
+    a->type = LVAL_QEXPR;
+    return a;
+}
+
+lval *builtin_eval(lenv *e, lval *a) {
+    LASSERT_NUM("eval", a, 1);
+    LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+
+    lval *x = lval_eval_sexpr(e, a->cell[0]);
+    lval_del(a);
+
+    return x;
+}
+
+lval *lval_join(lval *x, lval *y) {
+    /* append all the cells of 'y' to 'x' in one go */
+    int n = y->count;
+    if (n > 0) {
+        lval_reserve(x, x->count + n);
+        memcpy(&x->cell[x->count], y->cell, sizeof(lval *) * n);
+        x->count += n;
+    }
+
+    if (y->refs > 1 || y->base) {
+        /* a shared 'y' (or a view) is left intact,
+           so 'x' takes new references to its cells */
+        for (int i = 0; i < n; i++) {
+            lval_ref(y->cell[i]);
+        }
+    } else {
+        /* otherwise the cells are moved out of 'y' */
+        y->count = 0;
+    }
+
+    /* delete 'y' and return 'x' */
+    lval_del(y);
+
+    return x;
+}
+
+lval *builtin_join(lenv *e, lval *a) {
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+    }
+
+    lval *x = lval_own(lval_pop(a, 0));
+
+    /* lval_join consumes each of the remaining arguments */
+    for (int i = 0; i < a->count; i++) {
+        x = lval_join(x, a->cell[i]);
+    }
+    a->count = 0;
+
+    lval_del(a);
+
+    return x;
+}
+
+/* List library. These used to be defined in stdlib.lispx by recursion
+   over head/tail/join, mostly in quadratic time. They give what those
+   definitions gave: an item they take is evaluated, as 'fst' evaluated
+   it, and running off either end of a list fails with the error that
+   'head' or 'tail' gave there. */
+
+lval *builtin_len(lenv *e, lval *a) {
+    LASSERT_NUM("len", a, 1);
+    LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
+
+    long count = a->cell[0]->count;
+    lval_del(a);
+    return lval_num(count);
+}
+
+/* call function f with the argument x, and y unless it is NULL,
+   consuming both */
+lval *lval_apply(lenv *e, lval *f, lval *x, lval *y) {
+    lval *args = lval_add(lval_sexpr(), x);
+    if (y) {args = lval_add(args, y);}
+
+    return lval_call(e, f, args);
+}
+
+lval *builtin_nth(lenv *e, lval *a) {
+    LASSERT_NUM("nth", a, 2);
+    LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+    LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+
+    long n = lval_to_num(a->cell[0]);
+    long count = a->cell[1]->count;
+    LASSERT(a, n >= 0 && n <= count,
+            "Function 'tail' passed {} for argument 0.");
+    LASSERT(a, n < count, "Function 'head' passed {} for argument 0.");
+
+    lval *x = lval_eval(e, a->cell[1]->cell[n]);
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_last(lenv *e, lval *a) {
+    LASSERT_NUM("last", a, 1);
+    LASSERT_TYPE("last", a, 0, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY("tail", a, 0);
+
+    lval *l = a->cell[0];
+    lval *x = lval_eval(e, l->cell[l->count - 1]);
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_init(lenv *e, lval *a) {
+    LASSERT_NUM("init", a, 1);
+    LASSERT_TYPE("init", a, 0, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY("tail", a, 0);
+
+    lval *l = lval_take(a, 0);
+    return lval_slice(l, 0, l->count - 1);
+}
+
+lval *builtin_take(lenv *e, lval *a) {
+    LASSERT_NUM("take", a, 2);
+    LASSERT_TYPE("take", a, 0, LVAL_NUM);
+    LASSERT_TYPE("take", a, 1, LVAL_QEXPR);
+
+    long n = lval_to_num(a->cell[0]);
+    LASSERT(a, n >= 0 && n <= a->cell[1]->count,
+            "Function 'head' passed {} for argument 0.");
+
+    return lval_slice(lval_take(a, 1), 0, n);
+}
+
+lval *builtin_drop(lenv *e, lval *a) {
+    LASSERT_NUM("drop", a, 2);
+    LASSERT_TYPE("drop", a, 0, LVAL_NUM);
+    LASSERT_TYPE("drop", a, 1, LVAL_QEXPR);
+
+    long n = lval_to_num(a->cell[0]);
+    LASSERT(a, n >= 0 && n <= a->cell[1]->count,
+            "Function 'tail' passed {} for argument 0.");
+
+    lval *l = lval_take(a, 1);
+    return lval_slice(l, n, l->count);
+}
+
+lval *builtin_reverse(lenv *e, lval *a) {
+    LASSERT_NUM("reverse", a, 1);
+    LASSERT_TYPE("reverse", a, 0, LVAL_QEXPR);
+
+    lval *l = a->cell[0];
+    lval *x = lval_qexpr();
+    lval_reserve(x, l->count);
+    for (int i = l->count - 1; i >= 0; i--) {
+        x = lval_add(x, lval_ref(l->cell[i]));
+    }
+
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_elem(lenv *e, lval *a) {
+    LASSERT_NUM("elem", a, 2);
+    LASSERT_TYPE("elem", a, 1, LVAL_QEXPR);
+
+    lval *l = a->cell[1];
+    int found = 0;
+    for (int i = 0; i < l->count && !found; i++) {
+        lval *x = lval_eval(e, l->cell[i]);
+        if (lval_type(x) == LVAL_ERR) {
+            lval_del(a);
+            return x;
+        }
+        found = lval_eq(a->cell[0], x);
+        lval_del(x);
+    }
+
+    lval_del(a);
+    return lval_num(found);
+}
+
+lval *builtin_map(lenv *e, lval *a) {
+    LASSERT_NUM("map", a, 2);
+    LASSERT_TYPE("map", a, 0, LVAL_FUN);
+    LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
+
+    lval *f = a->cell[0];
+    lval *l = a->cell[1];
+    lval *x = lval_qexpr();
+    lval_reserve(x, l->count);
+    for (int i = 0; i < l->count; i++) {
+        lval *r = lval_eval(e, l->cell[i]);
+        if (lval_type(r) != LVAL_ERR) {r = lval_apply(e, f, r, NULL);}
+
+        /* the first error is the result */
+        if (lval_type(r) == LVAL_ERR) {
+            lval_del(x);
+            lval_del(a);
+            return r;
+        }
+        x = lval_add(x, r);
+    }
+
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_filter(lenv *e, lval *a) {
+    LASSERT_NUM("filter", a, 2);
+    LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+    LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
+
+    lval *f = a->cell[0];
+    lval *l = a->cell[1];
+    lval *x = lval_qexpr();
+    for (int i = 0; i < l->count; i++) {
+        /* the test sees the value of the item, but the item is kept */
+        lval *r = lval_eval(e, l->cell[i]);
+        if (lval_type(r) != LVAL_ERR) {r = lval_apply(e, f, r, NULL);}
+        if (lval_type(r) != LVAL_NUM) {
+            lval *err = r;
+            if (lval_type(r) != LVAL_ERR) {
+                err = lval_err("Function 'filter' passed a function "
+                               "returning %s, Expected %s.",
+                               ltype_name(lval_type(r)),
+                               ltype_name(LVAL_NUM));
+                lval_del(r);
+            }
+            lval_del(x);
+            lval_del(a);
+            return err;
+        }
+
+        if (lval_to_num(r)) {x = lval_add(x, lval_ref(l->cell[i]));}
+        lval_del(r);
+    }
+
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_foldl(lenv *e, lval *a) {
+    LASSERT_NUM("foldl", a, 3);
+    LASSERT_TYPE("foldl", a, 0, LVAL_FUN);
+    LASSERT_TYPE("foldl", a, 2, LVAL_QEXPR);
+
+    lval *f = a->cell[0];
+    lval *l = a->cell[2];
+    lval *z = lval_ref(a->cell[1]);
+    for (int i = 0; i < l->count && lval_type(z) != LVAL_ERR; i++) {
+        lval *x = lval_eval(e, l->cell[i]);
+        if (lval_type(x) == LVAL_ERR) {
+            lval_del(z);
+            z = x;
+        } else {
+            z = lval_apply(e, f, z, x);
+        }
+    }
+
+    lval_del(a);
+    return z;
+}
+
+lval *builtin_foldr(lenv *e, lval *a) {
+    LASSERT_NUM("foldr", a, 3);
+    LASSERT_TYPE("foldr", a, 0, LVAL_FUN);
+    LASSERT_TYPE("foldr", a, 2, LVAL_QEXPR);
+
+    /* the items are evaluated from the left, before any call */
+    lval *l = a->cell[2];
+    lval *v = lval_qexpr();
+    lval_reserve(v, l->count);
+    for (int i = 0; i < l->count; i++) {
+        lval *x = lval_eval(e, l->cell[i]);
+        if (lval_type(x) == LVAL_ERR) {
+            lval_del(v);
+            lval_del(a);
+            return x;
+        }
+        v = lval_add(v, x);
+    }
+
+    lval *f = a->cell[0];
+    lval *z = lval_ref(a->cell[1]);
+    for (int i = v->count - 1; i >= 0 && lval_type(z) != LVAL_ERR; i--) {
+        z = lval_apply(e, f, lval_ref(v->cell[i]), z);
+    }
+
+    lval_del(v);
+    lval_del(a);
+    return z;
+}
+
+lval *builtin_zip(lenv *e, lval *a) {
+    LASSERT_NUM("zip", a, 2);
+    LASSERT_TYPE("zip", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("zip", a, 1, LVAL_QEXPR);
+
+    lval *x = a->cell[0];
+    lval *y = a->cell[1];
+    int n = x->count < y->count ? x->count : y->count;
+    lval *v = lval_qexpr();
+    lval_reserve(v, n);
+    for (int i = 0; i < n; i++) {
+        lval *pair = lval_add(lval_qexpr(), lval_ref(x->cell[i]));
+        v = lval_add(v, lval_add(pair, lval_ref(y->cell[i])));
+    }
+
+    lval_del(a);
+    return v;
+}
+
+/* {{x0 y0...} {x1 y1...}} gives {{x0 x1} {y0... y1...}}, and {} gives
+   {nil nil} */
+lval *builtin_unzip(lenv *e, lval *a) {
+    LASSERT_NUM("unzip", a, 1);
+    LASSERT_TYPE("unzip", a, 0, LVAL_QEXPR);
+
+    lval *l = a->cell[0];
+    if (l->count == 0) {
+        lval_del(a);
+        return lval_add(lval_add(lval_qexpr(), lval_sym("nil")),
+                        lval_sym("nil"));
+    }
+
+    /* the values of the pairs */
+    lval *v = lval_qexpr();
+    lval_reserve(v, l->count);
+    for (int i = 0; i < l->count; i++) {
+        lval *p = lval_eval(e, l->cell[i]);
+        if (lval_type(p) != LVAL_ERR
+            && (lval_type(p) != LVAL_QEXPR || p->count == 0)) {
+            lval *err = lval_err("Function 'unzip' passed a list of %s, "
+                                 "Expected non-empty Q-Expressions.",
+                                 ltype_name(lval_type(p)));
+            lval_del(p);
+            p = err;
+        }
+        if (lval_type(p) == LVAL_ERR) {
+            lval_del(v);
+            lval_del(a);
+            return p;
+        }
+        v = lval_add(v, p);
+    }
+    lval_del(a);
+
+    lval *xs = lval_qexpr();
+    lval *ys = lval_qexpr();
+    for (int i = 0; i < v->count; i++) {
+        lval *p = v->cell[i];
+        xs = lval_add(xs, lval_ref(p->cell[0]));
+        for (int j = 1; j < p->count; j++) {
+            ys = lval_add(ys, lval_ref(p->cell[j]));
+        }
+    }
+
+    lval_del(v);
+    return lval_add(lval_add(lval_qexpr(), xs), ys);
+}
+
+lval *builtin_add(lenv *e,lval *a) {
+    return builtin_op(e, a, LNUM_ADD);
+}
+
+lval *builtin_sub(lenv *e,lval *a) {
+    return builtin_op(e, a, LNUM_SUB);
+}
+
+lval *builtin_mul(lenv *e,lval *a) {
+    return builtin_op(e, a, LNUM_MUL);
+}
+
+lval *builtin_div(lenv *e,lval *a) {
+    return builtin_op(e, a, LNUM_DIV);
+}
+
+lval *builtin(lenv *e, lval *a, char *func) {
+    if(strcmp("list", func) == 0) {return builtin_list(e, a);}
+    if(strcmp("head", func) == 0) {return builtin_head(e, a);}
+    if(strcmp("tail", func) == 0) {return builtin_tail(e, a);}
+    if(strcmp("join", func) == 0) {return builtin_join(e, a);}
+    if(strcmp("eval", func) == 0) {return builtin_eval(e, a);}
+    if(strcmp("len", func) == 0)  {return builtin_len(e, a);}
+
+    if(strcmp("+", func) == 0) {return builtin_op(e, a, LNUM_ADD);}
+    if(strcmp("-", func) == 0) {return builtin_op(e, a, LNUM_SUB);}
+    if(strcmp("*", func) == 0) {return builtin_op(e, a, LNUM_MUL);}
+    if(strcmp("/", func) == 0) {return builtin_op(e, a, LNUM_DIV);}
+
+    lval_del(a);
+    return lval_err("Unknown Funtcion!");
+}
+
+/* Evaluation never modifies the code it is given: lval_eval returns a
+   new reference to the value of v and leaves v to the caller, so a
+   function body is evaluated straight from the lambda every call. */
+
+/* evaluate the items of list v as an S-Expression, whatever its type.
+   Nested S-Expressions are kept on leval rather than the C stack. */
+lval *lval_eval_sexpr(lenv *e, lval *v) {
+    if (leval.nest == LMAX_NEST) {
+        return lval_err("Maximum depth of %i nested evaluations exceeded.",
+                        LMAX_NEST);
+    }
+    leval.nest++;
+
+    int base = leval.count;
+    lval *x = v;
+    for (;;) {
+        /* start on the S-Expression x: its values go into a new list */
+        if (x) {
+            if (leval.count == leval.cap) {
+                leval.cap = leval.cap ? leval.cap * 2 : 64;
+                leval.sexprs = realloc(leval.sexprs,
+                                       sizeof(lsexpr) * leval.cap);
+            }
+            lsexpr *s = &leval.sexprs[leval.count++];
+            s->code = x;
+            s->i = 0;
+            s->args = lval_sexpr();
+            lval_reserve(s->args, x->count);
+        }
+
+        /* evaluate children */
+        lsexpr *s = &leval.sexprs[leval.count - 1];
+        if (s->i < s->code->count) {
+            x = s->code->cell[s->i++];
+            if (lval_type(x) == LVAL_SEXPR && leval.count < LMAX_DEPTH) {
+                continue;
+            }
+            s->args->cell[s->args->count++] = lval_type(x) == LVAL_SEXPR
+                ? lval_err("Maximum depth of %li nested expressions "
+                           "exceeded.", LMAX_DEPTH)
+                : lval_eval(e, x);
+            x = NULL;
+            continue;
+        }
+
+        /* all children are evaluated: apply them */
+        leval.count--;
+        x = lval_eval_apply(e, s->args);
+        if (leval.count == base) {break;}
+
+        s = &leval.sexprs[leval.count - 1];
+        s->args->cell[s->args->count++] = x;
+        x = NULL;
+    }
+
+    leval.nest--;
+    return x;
+}
+
+/* apply the values v of the items of an S-Expression, consuming v */
+lval *lval_eval_apply(lenv *e, lval *v) {
+    /* error checking */
+    for(int i = 0; i < v->count; i++) {
+        if (lval_type(v->cell[i]) == LVAL_ERR) {
+            return lval_take(v, i);
+        }
+    }
+
+    /* empty expression */
+    if (v->count == 0) {return v;}
+
+    /* single expression */
+    if (v->count == 1) {return lval_take(v, 0);}
+
+    /* ensure first element is a function after evaluation */
+    lval *f = lval_pop(v, 0);
+    if (lval_type(f) != LVAL_FUN) {
+        lval *err = lval_err("S-Expression starts with incorrect type. "
+                             "Got %s, Expected %s.",
+                             ltype_name(lval_type(f)),
+                             ltype_name(LVAL_FUN));
+        lval_del(f);
+        lval_del(v);
+
+        return err;
+    }
+
+    /* if so call function to get result */
+    lval *result = lval_call(e, f, v);
+
+    lval_del(f);
+
+    return result;
+}
+
+lval *lval_eval(lenv *e, lval *v) {
+    if (lval_type(v) == LVAL_SYM) {
+        return lenv_get(e, v);
+    }
+
+    /* evaluate sexpressions */
+    if (lval_type(v) == LVAL_SEXPR) {
+        return lval_eval_sexpr(e, v);
+    }
+
+    /* all other lval types evaluate to themselves */
+    return lval_ref(v);
+}
+
+void lcode_emit(lcode *c, int op) {
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 16;
+        c->ops = realloc(c->ops, sizeof(int) * c->cap);
+    }
+    c->ops[c->count++] = op;
+}
+
+/* index of a new constant holding a reference to v */
+int lcode_const(lcode *c, lval *v) {
+    if (c->nconsts == c->maxconsts) {
+        c->maxconsts = c->maxconsts ? c->maxconsts * 2 : 8;
+        c->consts = realloc(c->consts, sizeof(lval *) * c->maxconsts);
+    }
+    c->consts[c->nconsts] = lval_ref(v);
+
+    return c->nconsts++;
+}
+
+/* the collector frees code without releasing its constants */
+void lcode_del(lcode *c, int release) {
+    if (release) {
+        for (int i = 0; i < c->nconsts; i++) {
+            lval_del(c->consts[i]);
+        }
+    }
+    free(c->consts);
+    free(c->caches);
+    free(c->ops);
+    free(c);
+}
+
+/* emit code leaving the value of x on the stack, as lval_eval would.
+   'tail' is set when that value is the value of the whole body */
+void lcode_expr(lcode *c, lval *x, int tail) {
+    switch(lval_type(x)) {
+    case LVAL_SYM: {
+        int slot = lcode_slot(c, x->sym);
+        lcode_emit(c, slot < 0 ? LOP_LOAD : LOP_LOCAL);
+        lcode_emit(c, lcode_const(c, x));
+        if (slot >= 0) {
+            lcode_emit(c, slot);
+        } else {
+            c->caches = realloc(c->caches, sizeof(lcache) * (c->ncaches + 1));
+            c->caches[c->ncaches].version = 0;
+            lcode_emit(c, c->ncaches++);
+        }
+        break;
+    }
+    case LVAL_SEXPR:
+        lcode_list(c, x, tail);
+        break;
+    default:
+        lcode_emit(c, LOP_CONST);
+        lcode_emit(c, lcode_const(c, x));
+        break;
+    }
+}
+
+/* emit code leaving the value of list x evaluated as an S-Expression */
+void lcode_list(lcode *c, lval *x, int tail) {
+    if (c->depth == LCODE_MAX_DEPTH) {
+        lcode_emit(c, LOP_EVAL);
+        lcode_emit(c, lcode_const(c, x));
+        return;
+    }
+
+    c->depth++;
+    lcode_form(c, x, tail);
+    c->depth--;
+}
+
+void lcode_form(lcode *c, lval *x, int tail) {
+    /* a single expression is its own value */
+    if (x->count == 1) {
+        lcode_expr(c, x->cell[0], tail);
+        return;
+    }
+
+    /* (if cond {then} {else}) runs the branch taken inline. At run
+       time LOP_IF checks that 'if' is still the builtin and the
+       condition a number, and otherwise calls it like any function */
+    if (x->count == 4
+        && lval_type(x->cell[0]) == LVAL_SYM && x->cell[0]->sym == lsym_if
+        && lval_type(x->cell[2]) == LVAL_QEXPR
+        && lval_type(x->cell[3]) == LVAL_QEXPR) {
+        lcode_expr(c, x->cell[0], 0);
+        lcode_expr(c, x->cell[1], 0);
+        lcode_emit(c, LOP_IF);
+        lcode_emit(c, lcode_const(c, x->cell[2]));
+        lcode_emit(c, lcode_const(c, x->cell[3]));
+        int patch = c->count;
+        lcode_emit(c, 0);
+        lcode_emit(c, 0);
+
+        lcode_list(c, x->cell[2], tail);
+        lcode_emit(c, LOP_JUMP);
+        int jump = c->count;
+        lcode_emit(c, 0);
+
+        c->ops[patch] = c->count;
+        lcode_list(c, x->cell[3], tail);
+        c->ops[patch + 1] = c->ops[jump] = c->count;
+        return;
+    }
+
+    /* (let {body}) runs the body inline in a new scope. LOP_LET checks
+       'let' is still the builtin, and otherwise calls it with the body */
+    if (x->count == 2
+        && lval_type(x->cell[0]) == LVAL_SYM && x->cell[0]->sym == lsym_let
+        && lval_type(x->cell[1]) == LVAL_QEXPR) {
+        lcode_expr(c, x->cell[0], 0);
+        lcode_emit(c, LOP_LET);
+        lcode_emit(c, lcode_const(c, x->cell[1]));
+        int patch = c->count;
+        lcode_emit(c, 0);
+
+        /* the scope is closed after the body, so nothing in it is in
+           tail position */
+        c->scopes++;
+        lcode_list(c, x->cell[1], 0);
+        c->scopes--;
+        lcode_emit(c, LOP_ENDLET);
+        c->ops[patch] = c->count;
+        return;
+    }
+
+    for (int i = 0; i < x->count; i++) {
+        lcode_expr(c, x->cell[i], 0);
+    }
+
+    /* (do ...) picks its value off the stack, if 'do' is the builtin */
+    if (x->count && lval_type(x->cell[0]) == LVAL_SYM
+        && x->cell[0]->sym == lsym_do) {
+        lcode_emit(c, LOP_DO);
+    } else {
+        lcode_emit(c, tail ? LOP_TAILAPPLY : LOP_APPLY);
+    }
+    lcode_emit(c, x->count);
+}
+
+/* The slot a formal of the function being compiled will occupy in its
+   activation frame, or -1 if 'sym' is not one of its formals. lval_bind
+   starts the frame with the bindings the function has captured, then
+   adds the formals in order (skipping '&'). The slot is only a guess:
+   the body may be shared with another lambda and '=' may turn the
+   frame into a hash table, so LOP_LOCAL checks it before use. */
+int lcode_slot(lcode *c, char *sym) {
+    lval *l = c->fn->formals;
+    if (c->fn->env->cap || c->scopes) {return -1;}
+
+    int slot = c->fn->env->count;
+    for (int i = 0; i < l->count && slot < LENV_SMALL; i++) {
+        if (l->cell[i]->sym == sym) {return slot;}
+        if (l->cell[i]->sym != lsym_amp) {slot++;}
+    }
+
+    return -1;
+}
+
+/* compile the body of lambda f, resolving its formals to slots */
+lcode *lcode_compile(lval *f) {
+    lcode *c = calloc(1, sizeof(lcode));
+    c->fn = f;
+    lcode_list(c, f->body, 1);
+    lcode_emit(c, LOP_RET);
+    c->fn = NULL;
+
+    return c;
+}
+
+/* the compiled body of lambda f, compiling it on first use */
+lcode *lvm_code(lval *f) {
+    if (!f->body->code) {f->body->code = lcode_compile(f);}
+    return f->body->code;
+}
+
+/* drop the compiled form of list v, which is about to be mutated */
+void lvm_forget(lval *v) {
+    if (v->code) {
+        lcode_del(v->code, 1);
+        v->code = NULL;
+    }
+}
+
+void lvm_push(lval *v) {
+    if (lvm.sp == lvm.maxsp) {
+        lvm.maxsp = lvm.maxsp ? lvm.maxsp * 2 : 256;
+        lvm.stack = realloc(lvm.stack, sizeof(lval *) * lvm.maxsp);
+    }
+    lvm.stack[lvm.sp++] = v;
+}
+
+/* push a frame running the body of f in its activation frame env,
+   taking over the reference to f and env */
+void lvm_enter(lval *f, lenv *env) {
+    if (lvm.fp == lvm.maxfp) {
+        lvm.maxfp = lvm.maxfp ? lvm.maxfp * 2 : 64;
+        lvm.frames = realloc(lvm.frames, sizeof(lframe) * lvm.maxfp);
+    }
+    lframe *fr = &lvm.frames[lvm.fp++];
+    fr->fn = f;
+    fr->env = env;
+    fr->code = lvm_code(f);
+    fr->pc = 0;
+}
+
+/* pop the top n values and apply them the way lval_eval_sexpr does.
+   When they call a lambda with all of its arguments, the lambda is
+   returned unevaluated with its activation frame in *frame, so the
+   caller can run it in a frame of its own */
+lval *lvm_apply(lenv *e, int n, lenv **frame) {
+    lvm.sp -= n;
+    lval **v = &lvm.stack[lvm.sp];
+    *frame = NULL;
+
+    /* error checking */
+    for (int i = 0; i < n; i++) {
+        if (lval_type(v[i]) == LVAL_ERR) {
+            lval *err = lval_ref(v[i]);
+            for (int j = 0; j < n; j++) {lval_del(v[j]);}
+            return err;
+        }
+    }
+
+    /* empty and single expressions */
+    if (n == 0) {return lval_sexpr();}
+    if (n == 1) {return v[0];}
+
+    /* ensure first element is a function */
+    lval *f = v[0];
+    if (lval_type(f) != LVAL_FUN) {
+        lval *err = lval_err("S-Expression starts with incorrect type. "
+                             "Got %s, Expected %s.",
+                             ltype_name(lval_type(f)),
+                             ltype_name(LVAL_FUN));
+        for (int j = 0; j < n; j++) {lval_del(v[j]);}
+        return err;
+    }
+
+    /* two fixnums passed to an arithmetic or comparison builtin need no
+       argument list, unless the result does not fit in a long */
+    if (n == 3 && f->builtin
+        && LVAL_IS_FIXNUM(v[1]) && LVAL_IS_FIXNUM(v[2])) {
+        int op = lnum_op(f->builtin);
+        lval *r = NULL;
+        if (op >= 0) {
+            r = lnum_binop(op, lval_to_num(v[1]), lval_to_num(v[2]));
+        }
+        if (r) {
+            lval_del(f);
+            return r;
+        }
+    }
+
+    /* the remaining values become the argument list */
+    lval *a = lval_sexpr();
+    lval_reserve(a, n - 1);
+    memcpy(a->cell, &v[1], sizeof(lval *) * (n - 1));
+    a->count = n - 1;
+
+    lval *r = f->builtin ? f->builtin(e, a) : lval_bind(e, f, a, frame);
+    if (*frame) {return f;}
+    lval_del(f);
+
+    return r;
+}
+
+/* run the body of f in the activation frame env, which is released
+   afterwards, and return its value */
+lval *lvm_run(lval *f, lenv *env) {
+    if (leval.nest == LMAX_NEST) {
+        lenv_del(env);
+        return lval_err("Maximum depth of %i nested evaluations exceeded.",
+                        LMAX_NEST);
+    }
+    leval.nest++;
+
+    int base = lvm.fp;
+    lvm_enter(lval_ref(f), env);
+
+    lcode *c = lvm.frames[base].code;
+    int pc = 0;
+    int n;
+    lenv *frame;
+    lval *x;
+
+    /* dispatch with computed goto where the compiler supports it */
+#ifdef __GNUC__
+    static void *ops[] = {
+        &&LOP_CONST, &&LOP_LOAD, &&LOP_LOCAL, &&LOP_APPLY, &&LOP_TAILAPPLY,
+        &&LOP_IF, &&LOP_DO, &&LOP_LET, &&LOP_ENDLET, &&LOP_EVAL, &&LOP_JUMP,
+        &&LOP_RET,
+    };
+#define LVM_OP(op) op:
+#define LVM_NEXT goto *ops[c->ops[pc]]
+    LVM_NEXT;
+#else
+#define LVM_OP(op) case op:
+#define LVM_NEXT continue
+    for (;;) switch(c->ops[pc]) {
+#endif
+
+    LVM_OP(LOP_CONST)
+        lvm_push(lval_ref(c->consts[c->ops[pc + 1]]));
+        pc += 2;
+        LVM_NEXT;
+
+    LVM_OP(LOP_LOAD) {
+        /* an unshadowed global is found through the inline cache while
+           the global environment is unchanged, or cached for next time */
+        lcache *ic = &c->caches[c->ops[pc + 2]];
+        x = c->consts[c->ops[pc + 1]];
+        if (LSYM(x->sym)->shadows == 0) {
+            if (ic->version == lic.version) {
+                lic.hits++;
+                lvm_push(lval_ref(lgc.env->vals[ic->slot]));
+                pc += 3;
+                LVM_NEXT;
+            }
+            n = lenv_slot(lgc.env, x->sym);
+            if (n >= 0) {
+                ic->version = lic.version;
+                ic->slot = n;
+            }
+        }
+        lic.misses++;
+        lvm_push(lenv_get(env, x));
+        pc += 3;
+        LVM_NEXT;
+    }
+
+    LVM_OP(LOP_LOCAL)
+        /* a formal is found in its slot without any searching, unless
+           this frame is not laid out as the compiler expected */
+        x = c->consts[c->ops[pc + 1]];
+        n = c->ops[pc + 2];
+        if (env->cap == 0 && n < env->count && env->syms[n] == x->sym) {
+            lvm_push(lval_ref(env->vals[n]));
+        } else {
+            lvm_push(lenv_get(env, x));
+        }
+        pc += 3;
+        LVM_NEXT;
+
+    LVM_OP(LOP_APPLY)
+        n = c->ops[pc + 1];
+        pc += 2;
+    apply:
+        x = lvm_apply(env, n, &frame);
+        if (!frame) {
+            lvm_push(x);
+            LVM_NEXT;
+        }
+        if (lvm.fp == LMAX_DEPTH) {goto deep;}
+
+        /* call: save our place and run the body in a new frame */
+        lvm.frames[lvm.fp - 1].pc = pc;
+        lvm_enter(x, frame);
+        c = lvm.frames[lvm.fp - 1].code;
+        env = frame;
+        pc = 0;
+        LVM_NEXT;
+
+    LVM_OP(LOP_TAILAPPLY)
+        n = c->ops[pc + 1];
+        pc += 2;
+        x = lvm_apply(env, n, &frame);
+        if (!frame) {
+            lvm_push(x);
+            LVM_NEXT;
+        }
+
+        /* The callee's frame would have ours as its parent. When it
+           rebinds everything bound in ours (as self recursion does),
+           nothing can see our frame any more: drop it and let the
+           callee take its place, so tail recursion runs in constant
+           space. Otherwise it is an ordinary call. */
+        if (lenv_shadows(frame, env)) {
+            frame->par = env->par;
+            lvm.fp--;
+            lenv_del(env);
+            lval_del(lvm.frames[lvm.fp].fn);
+        } else if (lvm.fp == LMAX_DEPTH) {
+            goto deep;
+        } else {
+            lvm.frames[lvm.fp - 1].pc = pc;
+        }
+        lvm_enter(x, frame);
+        c = lvm.frames[lvm.fp - 1].code;
+        env = frame;
+        pc = 0;
+        LVM_NEXT;
+
+    LVM_OP(LOP_IF)
+        /* the stack holds 'if' and the condition */
+        x = lvm.stack[lvm.sp - 2];
+        if (lval_type(x) == LVAL_FUN && x->builtin == builtin_if
+            && lval_type(lvm.stack[lvm.sp - 1]) == LVAL_NUM) {
+            long cond = lval_to_num(lvm.stack[lvm.sp - 1]);
+            lval_del(lvm.stack[--lvm.sp]);
+            lval_del(lvm.stack[--lvm.sp]);
+            pc = cond ? pc + 5 : c->ops[pc + 3];
+            LVM_NEXT;
+        }
+
+        /* otherwise push the branches and apply whatever 'if' is */
+        lvm_push(lval_ref(c->consts[c->ops[pc + 1]]));
+        lvm_push(lval_ref(c->consts[c->ops[pc + 2]]));
+        pc = c->ops[pc + 4];
+        n = 4;
+        goto apply;
+
+    LVM_OP(LOP_DO)
+        n = c->ops[pc + 1];
+        pc += 2;
+        x = lvm.stack[lvm.sp - n];
+        if (lval_type(x) != LVAL_FUN || x->builtin != builtin_do) {goto apply;}
+
+        /* the value is the last one, unless there is an error */
+        x = lvm.stack[lvm.sp - 1];
+        for (int i = lvm.sp - n + 1; i < lvm.sp; i++) {
+            if (lval_type(lvm.stack[i]) == LVAL_ERR) {
+                x = lvm.stack[i];
+                break;
+            }
+        }
+        lval_ref(x);
+        while (n--) {lval_del(lvm.stack[--lvm.sp]);}
+        lvm_push(x);
+        LVM_NEXT;
+
+    LVM_OP(LOP_LET)
+        x = lvm.stack[lvm.sp - 1];
+        if (lval_type(x) != LVAL_FUN || x->builtin != builtin_let) {
+            lvm_push(lval_ref(c->consts[c->ops[pc + 1]]));
+            pc = c->ops[pc + 2];
+            n = 2;
+            goto apply;
+        }
+        lval_del(lvm.stack[--lvm.sp]);
+
+        /* the frame runs in the new scope until LOP_ENDLET */
+        frame = lenv_new();
+        frame->par = env;
+        env = lvm.frames[lvm.fp - 1].env = frame;
+        pc += 3;
+        LVM_NEXT;
+
+    LVM_OP(LOP_ENDLET)
+        frame = env;
+        env = lvm.frames[lvm.fp - 1].env = frame->par;
+        lenv_del(frame);
+        pc += 1;
+        LVM_NEXT;
+
+    LVM_OP(LOP_EVAL)
+        lvm_push(lval_eval_sexpr(env, c->consts[c->ops[pc + 1]]));
+        pc += 2;
+        LVM_NEXT;
+
+    LVM_OP(LOP_JUMP)
+        pc = c->ops[pc + 1];
+        LVM_NEXT;
+
+    LVM_OP(LOP_RET)
+        /* the value stays on the stack for the caller */
+        lvm.fp--;
+        lenv_del(lvm.frames[lvm.fp].env);
+        lval_del(lvm.frames[lvm.fp].fn);
+        if (lvm.fp == base) {
+            leval.nest--;
+            return lvm.stack[--lvm.sp];
+        }
+
+        c = lvm.frames[lvm.fp - 1].code;
+        env = lvm.frames[lvm.fp - 1].env;
+        pc = lvm.frames[lvm.fp - 1].pc;
+        LVM_NEXT;
 
-    while(v->count > 1) {
-        lval_del(lval_pop(v, 1));
+    deep:
+        /* a call too deep for another frame gives an error instead */
+        lenv_del(frame);
+        lval_del(x);
+        lvm_push(lval_err("Maximum depth of %li nested calls exceeded.",
+                          LMAX_DEPTH));
+        LVM_NEXT;
+
+#ifndef __GNUC__
     }
+#endif
+#undef LVM_OP
+#undef LVM_NEXT
+}
 
-    return v;
+/* evaluate form x of a file being loaded, and free it */
+void lload_form(lenv *e, lval *x, int safe) {
+    lgc_root(x);
+    lval *y = lval_eval(e, x);
+    lgc_unroot();
+    lval_del(x);
+
+    /* If Evaluation leads to error print it  */
+    if (lval_type(y) == LVAL_ERR) {lval_println(y);}
+    lval_del(y);
+
+    if (safe) {lgc_safepoint();}
 }
-lval *builtin_tail(lenv *e, lval *a) {
-    /* check error conditions */
-    LASSERT_NUM("tail", a, 1);
-    LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY("tail", a, 0);
 
-    /* take first argument */
-    lval *v = lval_take(a, 0);
-    /* delete first element and return */
-    lval_del(lval_pop(v, 0));
+lval *builtin_load(lenv *e, lval *a) {
+    LASSERT_NUM("load", a, 1);
+    LASSERT_TYPE("load", a, 0, LVAL_STR);
 
-    return v;
+    /* the file is mapped and each form evaluated as soon as it is read,
+       so memory is bounded by the largest form, not the file */
+    long size;
+    char *src = lfile_map(a->cell[0]->str, &size);
+    if (!src) {
+        lval *err = lval_err("Could not load library %s: %s",
+                             a->cell[0]->str, strerror(errno));
+        lval_del(a);
+        return err;
+    }
+    lreader r = {src, src + size, 1};
+    long dropped = 0;
+
+    /* Only a load made from the top level may collect between
+       forms, nested loads run with live values on the C stack */
+    int safe = lgc.safe;
+    lgc.safe = 0;
+    lgc_root(a);
+
+    lval *x;
+    lval *err = NULL;
+    while ((x = lread_form(&r))) {
+        /* a form that does not read ends the load */
+        if (lval_type(x) == LVAL_ERR) {
+            err = lval_err("Could not load library %s, %s",
+                           a->cell[0]->str, x->err);
+            lval_del(x);
+            break;
+        }
+
+        lload_form(e, x, safe);
+
+        /* the text read so far is not needed any more */
+        if (r.p - src - dropped >= LFILE_DROP_STEP) {
+            dropped = lfile_drop(src, r.p - src);
+        }
+    }
+
+    lgc_unroot();
+    lgc.safe = safe;
+
+    lread_free(&r);
+    lfile_unmap(src, size);
+    lval_del(a);
+
+    /* Return empty list */
+    return err ? err : lval_sexpr();
 }
 
-lval *builtin_list(lenv *e, lval *a) {
-    a->type = LVAL_QEXPR;
-    return a;
+/* FNV-1a style hash of n bytes, taken a word at a time */
+unsigned long limg_sum(char *p, long n) {
+    unsigned long h = 2166136261UL;
+    long i = 0;
+    for (; i + (long)sizeof(long) <= n; i += sizeof(long)) {
+        unsigned long w;
+        memcpy(&w, p + i, sizeof(long));
+        h = (h ^ w) * 1099511628211UL;
+        h ^= h >> 29;
+    }
+    for (; i < n; i++) {
+        h ^= (unsigned char)p[i];
+        h *= 16777619UL;
+    }
+
+    return h;
 }
 
-lval *builtin_eval(lenv *e, lval *a) {
-    LASSERT_NUM("eval", a, 1);
-    LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+/* hash of the names of the builtins, in order, so an image is not read
+   by a binary whose builtins have different indices */
+unsigned long limg_builtins(void) {
+    unsigned long h = lbuiltins.count;
+    for (int i = 0; i < lbuiltins.count; i++) {
+        h = h * 31 + lsym_hash(lbuiltins.names[i]);
+    }
 
-    lval *x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
+    return h;
+}
 
-    return lval_eval(e, x);
+void limg_put(limg_buf *b, void *p, long n) {
+    if (b->len + n > b->cap) {
+        while (b->len + n > b->cap) {b->cap = b->cap ? b->cap * 2 : 4096;}
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
 }
 
-lval *lval_join(lval *x, lval *y) {
-    /* for each cell in 'y' and it to 'x' */
-    while(y->count) {
-        x = lval_add(x, lval_pop(y, 0));
+/* numbers are written 7 bits a byte, low bits first, with the sign
+   moved to the lowest bit so that small negative numbers stay short */
+void limg_put_long(limg_buf *b, long x) {
+    unsigned long u = ((unsigned long)x << 1) ^ (x < 0 ? ~0UL : 0);
+    unsigned char c[10];
+    int n = 0;
+    while (u >= 0x80) {
+        c[n++] = (unsigned char)(u | 0x80);
+        u >>= 7;
     }
+    c[n++] = (unsigned char)u;
+    limg_put(b, c, n);
+}
 
-    /* delete the empty 'y' and return 'x' */
-    lval_del(y);
+/* a string is its length, then its bytes and the terminating NUL */
+void limg_put_str(limg_buf *b, char *s) {
+    limg_put_mem(b, s, strlen(s));
+}
 
-    return x;
+/* the n bytes at s, which may hold NULs, written as a string */
+void limg_put_mem(limg_buf *b, char *s, long n) {
+    limg_put_long(b, n);
+    limg_put(b, s, n);
+    limg_put(b, "", 1);
 }
 
-lval *builtin_join(lenv *e, lval *a) {
-    for (int i = 0; i < a->count; i++) {
-        LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+/* the order 'key' (a value with other owners, or the name of a symbol)
+   was written in if it has been written already. Otherwise -1, and
+   'key' is given the next order. */
+long limg_shared(limg_buf *b, void *key) {
+    /* keep the table at most half full */
+    if ((b->count + 1) * 2 > b->slots) {
+        long slots = b->slots;
+        void **vals = b->vals;
+        long *ids = b->ids;
+
+        b->slots = slots ? slots * 2 : 256;
+        b->vals = calloc(b->slots, sizeof(void *));
+        b->ids = malloc(sizeof(long) * b->slots);
+        for (long i = 0; i < slots; i++) {
+            if (!vals[i]) {continue;}
+            unsigned long j = lenv_hash(vals[i]) & (b->slots - 1);
+            while (b->vals[j]) {j = (j + 1) & (b->slots - 1);}
+            b->vals[j] = vals[i];
+            b->ids[j] = ids[i];
+        }
+        free(vals);
+        free(ids);
     }
 
-    lval *x = lval_pop(a, 0);
-
-    while(a->count) {
-        x = lval_join(x, lval_pop(a, 0));
+    unsigned long i = lenv_hash(key) & (b->slots - 1);
+    while (b->vals[i]) {
+        if (b->vals[i] == key) {return b->ids[i];}
+        i = (i + 1) & (b->slots - 1);
     }
+    b->vals[i] = key;
+    b->ids[i] = b->count++;
 
-    lval_del(a);
+    return -1;
+}
 
-    return x;
+/* each symbol is written once, as a shared value */
+void limg_put_sym(limg_buf *b, char *sym) {
+    long id = limg_shared(b, sym);
+    unsigned char tag = id >= 0 ? LIMG_REF : LIMG_SYM | LIMG_SHARED;
+    limg_put(b, &tag, 1);
+    if (id >= 0) {
+        limg_put_long(b, id);
+    } else {
+        limg_put_str(b, sym);
+    }
 }
 
-lval *builtin_len(lenv *e, lval *a) {
-    LASSERT(a, a->count == 1,
-            "Function 'head' passed too many arguments");
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-            "Funtion 'len' passed incorrect type.");
+/* the next item of list or lambda v from position *i on, NULL after the
+   last. The items of a lambda are its formals, its body, and the values
+   bound in its environment. */
+lval *limg_item(lval *v, int *i) {
+    if (v->type != LVAL_FUN) {
+        return *i < v->count ? v->cell[(*i)++] : NULL;
+    }
 
-    long count = a->cell[0]->count;
-    lval_del(a);
-    return lval_num(count);
+    if (*i == 0) {(*i)++; return v->formals;}
+    if (*i == 1) {(*i)++; return v->body;}
+
+    lenv *e = v->env;
+    int n = e->cap ? e->cap : e->count;
+    while (*i - 2 < n) {
+        int j = (*i)++ - 2;
+        if (e->syms[j]) {return e->vals[j];}
+    }
+
+    return NULL;
 }
 
-lval *builtin_add(lenv *e,lval *a) {
-    return builtin_op(e, a, "+");
+void limg_put_val(limg_buf *b, lval *v) {
+    /* lists and lambdas being written, with the next item to write */
+    lstack open = {0};
+
+    while (v) {
+        long id = -1;
+        unsigned char tag;
+        if (!LVAL_IS_IMM(v) && v->type != LVAL_SYM && v->refs > 1) {
+            id = limg_shared(b, v);
+        }
+
+        if (lval_type(v) == LVAL_SYM) {
+            limg_put_sym(b, v->sym);
+        } else if (id >= 0) {
+            tag = LIMG_REF;
+            limg_put(b, &tag, 1);
+            limg_put_long(b, id);
+        } else {
+            switch (lval_type(v)) {
+            case LVAL_NUM: tag = LIMG_NUM; break;
+            case LVAL_DBL: tag = LIMG_DBL; break;
+            case LVAL_BIG: tag = LIMG_BIG; break;
+            case LVAL_ERR: tag = LIMG_ERR; break;
+            case LVAL_STR: tag = LIMG_STR; break;
+            case LVAL_BUILDER: tag = LIMG_BUILDER; break;
+            case LVAL_FUN:
+                tag = v->builtin ? LIMG_BUILTIN : LIMG_LAMBDA;
+                break;
+            case LVAL_SEXPR: tag = LIMG_SEXPR; break;
+            default: tag = LIMG_QEXPR; break;
+            }
+            if (!LVAL_IS_IMM(v) && v->refs > 1) {tag |= LIMG_SHARED;}
+            limg_put(b, &tag, 1);
+
+            switch (tag & ~LIMG_SHARED) {
+            case LIMG_NUM: limg_put_long(b, lval_to_num(v)); break;
+            case LIMG_DBL: {
+                double x = lval_to_dbl(v);
+                limg_put(b, &x, sizeof(x));
+                break;
+            }
+            case LIMG_BIG:
+                /* the number of digits, negated for a negative number */
+                limg_put_long(b, v->bneg ? -v->blen : v->blen);
+                for (int i = 0; i < v->blen; i++) {
+                    limg_put_long(b, v->big[i]);
+                }
+                break;
+            case LIMG_ERR: limg_put_str(b, v->err); break;
+            case LIMG_STR:
+            case LIMG_BUILDER: limg_put_mem(b, v->str, v->slen); break;
+            case LIMG_BUILTIN: {
+                long i = 0;
+                while (lbuiltins.funcs[i] != v->builtin) {i++;}
+                limg_put_long(b, i);
+                break;
+            }
+            case LIMG_LAMBDA: {
+                /* the bound symbols come first, their values last */
+                lenv *e = v->env;
+                int n = e->cap ? e->cap : e->count;
+                limg_put_long(b, e->count);
+                for (int i = 0; i < n; i++) {
+                    if (e->syms[i]) {limg_put_sym(b, e->syms[i]);}
+                }
+                lstack_push(&open, v, 0);
+                break;
+            }
+            default:
+                limg_put_long(b, v->count);
+                lstack_push(&open, v, 0);
+                break;
+            }
+        }
+
+        /* move on to the next item still to be written */
+        v = NULL;
+        while (open.count && !v) {
+            lwalk *w = &open.items[open.count - 1];
+            v = limg_item(w->v, &w->i);
+            if (!v) {open.count--;}
+        }
+    }
+
+    free(open.items);
 }
 
-lval *builtin_sub(lenv *e,lval *a) {
-    return builtin_op(e, a, "-");
+/* write an image of the global environment 'e', as it is after loading
+   'src' (of 'size' bytes hashing to 'sum'), to the file 'image'. The
+   modules 'src' imported are lmods.paths[mods] on. Return 0 with errno
+   set if it cannot be written. */
+int limg_dump(lenv *e, char *image, char *src, long size,
+              unsigned long sum, int mods) {
+    limg_buf b = {0};
+    limg_put_str(&b, src);
+    limg_put_long(&b, size);
+    limg_put_long(&b, sum);
+
+    /* the modules are written as a list of their paths */
+    lval *m = lval_qexpr();
+    for (int i = mods; i < lmods.count; i++) {
+        m = lval_add(m, lval_str(lmods.paths[i]));
+    }
+    limg_put_val(&b, m);
+    lval_del(m);
+
+    /* the environment is written as a list of symbols and values */
+    unsigned char tag = LIMG_QEXPR;
+    int n = e->cap ? e->cap : e->count;
+    limg_put(&b, &tag, 1);
+    limg_put_long(&b, e->count * 2);
+    for (int i = 0; i < n; i++) {
+        if (!e->syms[i]) {continue;}
+        limg_put_sym(&b, e->syms[i]);
+        limg_put_val(&b, e->vals[i]);
+    }
+
+    int ok = limg_write(image, LIMG_MAGIC, &b);
+    limg_buf_free(&b);
+    return ok;
 }
 
-lval *builtin_mul(lenv *e,lval *a) {
-    return builtin_op(e, a, "*");
+/* write the file 'name': a header of 'magic', the format, the builtins
+   and a checksum, then what was written to b. Return 0 with errno set
+   if it cannot be written. */
+int limg_write(char *name, char *magic, limg_buf *b) {
+    limg_buf h = {0};
+    limg_put(&h, magic, strlen(magic) + 1);
+    limg_put_long(&h, LIMG_VERSION);
+    limg_put_long(&h, limg_builtins());
+    limg_put_long(&h, limg_sum(b->data, b->len));
+    limg_put_long(&h, b->len);
+
+    /* write a temporary file and rename it over the old one, so another
+       run never sees half a file */
+    char *tmp = malloc(strlen(name) + 5);
+    sprintf(tmp, "%s.tmp", name);
+    FILE *f = fopen(tmp, "wb");
+    int ok = f != NULL;
+    if (f) {
+        ok = fwrite(h.data, 1, h.len, f) == (size_t)h.len
+            && fwrite(b->data, 1, b->len, f) == (size_t)b->len;
+        ok = fclose(f) == 0 && ok;
+        ok = ok && rename(tmp, name) == 0;
+        if (!ok) {remove(tmp);}
+    }
+
+    free(tmp);
+    free(h.data);
+    return ok;
 }
 
-lval *builtin_div(lenv *e,lval *a) {
-    return builtin_op(e, a, "/");
+void limg_buf_free(limg_buf *b) {
+    free(b->data);
+    free(b->vals);
+    free(b->ids);
 }
 
-lval *builtin(lenv *e, lval *a, char *func) {
-    if(strcmp("list", func) == 0) {return builtin_list(e, a);}
-    if(strcmp("head", func) == 0) {return builtin_head(e, a);}
-    if(strcmp("tail", func) == 0) {return builtin_tail(e, a);}
-    if(strcmp("join", func) == 0) {return builtin_join(e, a);}
-    if(strcmp("eval", func) == 0) {return builtin_eval(e, a);}
-    if(strcmp("len", func) == 0)  {return builtin_len(e, a);}
+/* check the header of the file being read, as written by limg_write,
+   leaving r at what follows it. Return 0 if it is not 'magic', or not
+   written by a binary like this one, or damaged. */
+int limg_open(limg_in *r, char *magic) {
+    long n = strlen(magic) + 1;
+    char *m = limg_get(r, n);
+    long version, builtins, sum, len;
+
+    return m && memcmp(m, magic, n) == 0
+        && limg_get_long(r, &version) && version == LIMG_VERSION
+        && limg_get_long(r, &builtins)
+        && (unsigned long)builtins == limg_builtins()
+        && limg_get_long(r, &sum)
+        && limg_get_long(r, &len) && len == r->end - r->p
+        && (unsigned long)sum == limg_sum(r->p, len);
+}
 
-    if(strstr("+-*/", func)) {return builtin_op(e, a, func);}
+void limg_in_free(limg_in *r) {
+    if (r->shared) {lval_del(r->shared);}
+}
 
-    lval_del(a);
-    return lval_err("Unknown Funtcion!");
+/* the next n bytes of the image, NULL if it is shorter than that */
+char *limg_get(limg_in *r, long n) {
+    if (n < 0 || n > r->end - r->p) {return NULL;}
+    r->p += n;
+    return r->p - n;
 }
 
-lval *lval_eval_sexpr(lenv *e, lval *v) {
-    /* evaluate children */
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
+int limg_get_long(limg_in *r, long *x) {
+    unsigned long u = 0;
+    for (int shift = 0; r->p < r->end && shift < 64; shift += 7) {
+        unsigned char c = *r->p++;
+        u |= (unsigned long)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *x = (long)(u >> 1) ^ -(long)(u & 1);
+            return 1;
+        }
     }
 
-    /* error checking */
-    for(int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) {
-            return lval_take(v, i);
-        }
+    return 0;
+}
+
+/* add v to the shared values read */
+void limg_keep(limg_in *r, lval *v) {
+    if (!r->shared) {r->shared = lval_qexpr();}
+    lval_add(r->shared, v);
+}
+
+/* shared value n, NULL if there is none (yet) */
+lval *limg_ref(limg_in *r, long n) {
+    if (!r->shared || n < 0 || n >= r->shared->count
+        || LVAL_IS_FIXNUM(r->shared->cell[n])) {
+        return NULL;
     }
+    return lval_ref(r->shared->cell[n]);
+}
 
-    /* empty expression */
-    if (v->count == 0) {return v;}
+/* a string of the image, in place, NULL if it is not well formed */
+char *limg_get_str(limg_in *r) {
+    long n;
+    char *s = limg_get_mem(r, &n);
+    if (!s || (long)strlen(s) != n) {return NULL;}
+    return s;
+}
 
-    /* single expression */
-    if (v->count == 1) {return lval_take(v, 0);}
+/* a string of the image that may hold NULs, in place, setting *n to
+   its length. NULL if it is not well formed. */
+char *limg_get_mem(limg_in *r, long *n) {
+    if (!limg_get_long(r, n) || *n < 0) {return NULL;}
+    char *s = limg_get(r, *n + 1);
+    if (!s || s[*n]) {return NULL;}
+    return s;
+}
 
-    /* ensure first element is a function after evaluation */
-    lval *f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        lval *err = lval_err("S-Expression starts with incorrect type. "
-                             "Got %i, Expected %s.",
-                             ltype_name(f->type),
-                             ltype_name(LVAL_FUN));
-        lval_del(f);
+/* a symbol of the image, as written by limg_put_sym */
+lval *limg_get_sym(limg_in *r) {
+    unsigned char *t = (unsigned char *)limg_get(r, 1);
+    long n;
+    char *s;
+
+    if (t && *t == (LIMG_SYM | LIMG_SHARED) && (s = limg_get_str(r))) {
+        lval *x = lval_sym(s);
+        limg_keep(r, lval_ref(x));
+        return x;
+    }
+    lval *x = NULL;
+    if (t && *t == LIMG_REF && limg_get_long(r, &n)) {x = limg_ref(r, n);}
+    if (x && x->type != LVAL_SYM) {
+        lval_del(x);
+        x = NULL;
+    }
+
+    return x;
+}
+
+/* the value a list or lambda that has all its items read stands for,
+   or NULL if it is not well formed */
+lval *limg_finish(limg_list *l) {
+    lval *v = l->v;
+    if (l->tag != LIMG_LAMBDA) {return v;}
+
+    int n = (v->count - 2) / 2;
+    lval *formals = v->cell[n];
+    lval *body = v->cell[n + 1];
+    int ok = lval_type(formals) == LVAL_QEXPR
+        && (lval_type(body) == LVAL_QEXPR || lval_type(body) == LVAL_SEXPR);
+    for (int i = 0; ok && i < formals->count; i++) {
+        ok = lval_type(formals->cell[i]) == LVAL_SYM;
+    }
+    if (!ok) {
         lval_del(v);
+        return NULL;
+    }
 
-        return err;
+    lval *f = lval_lambda(lval_ref(formals), lval_ref(body));
+    for (int i = 0; i < n; i++) {
+        lenv_put(f->env, v->cell[i], v->cell[n + 2 + i]);
     }
+    lval_del(v);
 
-    /* if so call function to get result */
-    lval *result = lval_call(e, f, v);
+    return f;
+}
 
-    lval_del(f);
+/* read the next value of the image, NULL if it is not well formed */
+lval *limg_get_val(limg_in *r) {
+    /* lists and lambdas being read */
+    limg_list *open = NULL;
+    int count = 0;
+    int cap = 0;
+    lval *x = NULL;
 
-    return result;
+    for (;;) {
+        unsigned char *t = (unsigned char *)limg_get(r, 1);
+        if (!t) {goto bad;}
+        int tag = *t & ~LIMG_SHARED;
+        long id = -1;
+        if (*t & LIMG_SHARED) {
+            /* it can only be referred to once it is read to the end */
+            limg_keep(r, lval_num(0));
+            id = r->shared->count - 1;
+        }
+
+        long n;
+        char *s;
+        switch (tag) {
+        case LIMG_NUM:
+            if (!limg_get_long(r, &n)) {goto bad;}
+            x = lval_num(n);
+            break;
+        case LIMG_DBL: {
+            double d;
+            if (!(s = limg_get(r, sizeof(d)))) {goto bad;}
+            memcpy(&d, s, sizeof(d));
+            x = lval_dbl(d);
+            break;
+        }
+        case LIMG_BIG: {
+            /* every digit takes a byte at least */
+            if (!limg_get_long(r, &n) || n == 0 || labs(n) > r->end - r->p
+                || n != (int)n) {
+                goto bad;
+            }
+            x = lbig_new(labs(n));
+            x->bneg = n < 0;
+            int ok = 1;
+            for (int i = 0; ok && i < x->blen; i++) {
+                long d;
+                ok = limg_get_long(r, &d) && d >= 0 && d <= UINT32_MAX;
+                x->big[i] = ok ? d : 0;
+            }
+            if (!ok || x->big[x->blen - 1] == 0) {
+                lval_del(x);
+                goto bad;
+            }
+            x = lbig_norm(x);
+            break;
+        }
+        case LIMG_ERR:
+        case LIMG_SYM:
+            if (!(s = limg_get_str(r))) {goto bad;}
+            x = tag == LIMG_ERR ? lval_err("%s", s) : lval_sym(s);
+            break;
+        case LIMG_STR:
+            if (!(s = limg_get_mem(r, &n))) {goto bad;}
+            x = lval_strn(s, n);
+            break;
+        case LIMG_BUILDER:
+            if (!(s = limg_get_mem(r, &n))) {goto bad;}
+            x = lval_builder();
+            lstr_add(x, s, n);
+            break;
+        case LIMG_BUILTIN:
+            if (!limg_get_long(r, &n) || n < 0 || n >= lbuiltins.count) {
+                goto bad;
+            }
+            x = lval_fun(lbuiltins.funcs[n]);
+            break;
+        case LIMG_REF:
+            /* only a value read to the end can be referred to */
+            if (!limg_get_long(r, &n) || !(x = limg_ref(r, n))) {goto bad;}
+            break;
+        case LIMG_LAMBDA:
+        case LIMG_SEXPR:
+        case LIMG_QEXPR:
+            /* every item takes a byte at least */
+            if (!limg_get_long(r, &n) || n < 0 || n > r->end - r->p
+                || n != (int)n) {
+                goto bad;
+            }
+            if (count == cap) {
+                cap = cap ? cap * 2 : 64;
+                open = realloc(open, sizeof(limg_list) * cap);
+            }
+            lval *l = tag == LIMG_SEXPR ? lval_sexpr() : lval_qexpr();
+            open[count++] = (limg_list){l, n, tag, id};
+            if (tag == LIMG_LAMBDA) {
+                open[count - 1].left = n + 2;
+                for (long i = 0; i < n; i++) {
+                    lval *k = limg_get_sym(r);
+                    if (!k) {goto bad;}
+                    lval_add(l, k);
+                }
+            }
+            lval_reserve(l, l->count + open[count - 1].left);
+            if (open[count - 1].left) {continue;}
+
+            /* an empty list is read to the end already */
+            x = limg_finish(&open[--count]);
+            break;
+        default:
+            goto bad;
+        }
+
+        /* x is read to the end: add it to the list it is an item of,
+           which may be read to the end in turn */
+        while (x) {
+            if (id >= 0) {r->shared->cell[id] = lval_ref(x);}
+            if (!count) {
+                free(open);
+                return x;
+            }
+
+            limg_list *l = &open[count - 1];
+            lval_add(l->v, x);
+            x = NULL;
+            if (--l->left == 0) {
+                id = l->id;
+                x = limg_finish(l);
+                count--;
+                if (!x) {goto bad;}
+            }
+        }
+    }
+
+bad:
+    if (x) {lval_del(x);}
+    while (count) {lval_del(open[--count].v);}
+    free(open);
+    return NULL;
 }
 
-lval *lval_eval(lenv *e, lval *v) {
-    if (v->type == LVAL_SYM) {
-        lval *x = lenv_get(e, v);
-        lval_del(v);
-        return x;
+/* restore the global environment 'e' from the file 'image' if it was
+   written after loading 'src' as it is now, 'size' bytes hashing to
+   'sum', and add the modules 'src' imported to lmods. Return 0 and
+   leave 'e' and lmods alone if the image is missing, stale or not well
+   formed. */
+int limg_restore(lenv *e, char *image, char *src, long size,
+                 unsigned long sum) {
+    long len;
+    char *data = lfile_map(image, &len);
+    if (!data) {return 0;}
+
+    limg_in r = {data, data + len};
+    long src_size, src_sum;
+    char *name;
+    int ok = limg_open(&r, LIMG_MAGIC)
+        && (name = limg_get_str(&r)) && strcmp(name, src) == 0
+        && limg_get_long(&r, &src_size) && src_size == size
+        && limg_get_long(&r, &src_sum) && (unsigned long)src_sum == sum;
+
+    /* read everything before touching the environment */
+    lval *m = ok ? limg_get_val(&r) : NULL;
+    ok = m && lval_type(m) == LVAL_QEXPR;
+    for (int i = 0; ok && i < m->count; i++) {
+        ok = lval_type(m->cell[i]) == LVAL_STR;
+    }
+    lval *v = ok ? limg_get_val(&r) : NULL;
+    ok = v && r.p == r.end && lval_type(v) == LVAL_QEXPR
+        && v->count % 2 == 0;
+    for (int i = 0; ok && i < v->count; i += 2) {
+        ok = lval_type(v->cell[i]) == LVAL_SYM;
+    }
+    for (int i = 0; ok && i < v->count; i += 2) {
+        lenv_put(e, v->cell[i], v->cell[i + 1]);
     }
 
-    /* evaluate sexpressions */
-    if (v->type == LVAL_SEXPR) {
-        return lval_eval_sexpr(e, v);
+    /* the modules are not imported again, as after loading 'src' */
+    for (int i = 0; ok && i < m->count; i++) {
+        char *path = malloc(m->cell[i]->slen + 1);
+        strcpy(path, m->cell[i]->str);
+        lmod_add(path);
     }
 
-    /* all other lval types remain the same */
-    return v;
+    if (m) {lval_del(m);}
+    if (v) {lval_del(v);}
+    limg_in_free(&r);
+    lfile_unmap(data, len);
+    return ok;
 }
 
-lval *builtin_load(lenv *e, lval *a) {
-    LASSERT_NUM("load", a, 1);
-    LASSERT_TYPE("load", a, 0, LVAL_STR);
+/* load source file 'src' through the image file 'image': restore the
+   global environment from the image if it was written after loading
+   'src' as it is now, otherwise load 'src' and write a new image. The
+   image holds the whole global environment, so this is meant for the
+   first file loaded. Only the state 'src' leaves behind is restored:
+   what its top-level forms printed is not printed again. */
+lval *limg_load(lenv *e, char *image, char *src) {
+    long size;
+    char *text = lfile_map(src, &size);
+    unsigned long sum = 0;
+    if (text) {
+        sum = limg_sum(text, size);
+        lfile_unmap(text, size);
+        if (limg_restore(e, image, src, size, sum)) {return lval_sexpr();}
+    }
+
+    int mods = lmods.count;
+    lval *x = builtin_load(e, lval_add(lval_sexpr(), lval_str(src)));
+    if (text && lval_type(x) != LVAL_ERR
+        && !limg_dump(e, image, src, size, sum, mods)) {
+        lval *err = lval_err("Could not write image %s: %s",
+                             image, strerror(errno));
+        lval_println(err);
+        lval_del(err);
+    }
 
-    /* Parse File given by string name */
-    mpc_result_t r;
-    if (mpc_parse_contents(a->cell[0]->str, Lispx, &r)) {
+    return x;
+}
 
-        /* Read contents */
-        lval *expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
+/* the path of the module 'name', which names a file with or without
+   its .lispx suffix, in a new string, or NULL with errno set */
+char *lmod_resolve(char *name) {
+    char *file = malloc(strlen(name) + sizeof(".lispx"));
+    strcpy(file, name);
+
+    struct stat st;
+    if (stat(file, &st) != 0 || !S_ISREG(st.st_mode)) {
+        strcat(file, ".lispx");
+        if (stat(file, &st) != 0) {
+            free(file);
+            return NULL;
+        }
+    }
 
-        /* Evaluate each Expression */
-        while(expr->count) {
-            lval *x = lval_eval(e, lval_pop(expr, 0));
-            /* If Evaluation leads to error print it  */
-            if (x->type == LVAL_ERR) {lval_println(x);}
-            lval_del(x);
+#ifdef _WIN32
+    return file;
+#else
+    /* so that every way of naming a file imports it once */
+    char *path = realpath(file, NULL);
+    free(file);
+    return path;
+#endif
+}
+
+/* add 'path' to the modules and return 1, or free it and return 0 if
+   it was there already */
+int lmod_add(char *path) {
+    for (int i = 0; i < lmods.count; i++) {
+        if (strcmp(lmods.paths[i], path) == 0) {
+            free(path);
+            return 0;
         }
+    }
 
-        /* Delete expressions and arguments */
-        lval_del(expr);
-        lval_del(a);
+    if (lmods.count == lmods.cap) {
+        lmods.cap = lmods.cap ? lmods.cap * 2 : 16;
+        lmods.paths = realloc(lmods.paths, sizeof(char *) * lmods.cap);
+    }
+    lmods.paths[lmods.count++] = path;
+    return 1;
+}
+
+/* forget a module that failed to load, so it can be imported again */
+void lmod_remove(char *path) {
+    for (int i = 0; i < lmods.count; i++) {
+        if (lmods.paths[i] == path) {
+            free(path);
+            lmods.paths[i] = lmods.paths[--lmods.count];
+            return;
+        }
+    }
+}
+
+/* modification time of a file, as precisely as it is known */
+long lfile_mtime(struct stat *st) {
+#ifdef _WIN32
+    return st->st_mtime;
+#else
+    return st->st_mtim.tv_sec * 1000000000L + st->st_mtim.tv_nsec;
+#endif
+}
+
+/* Evaluate module 'path'. Its forms are cached after the first time in
+   the file 'path' followed by "c", with the size, modification time and
+   hash of the source they were read from. The cache is used as is if
+   the size and time match, and after checking the hash if only the
+   size does. Otherwise the source is read, and cached when it all
+   reads. Forms fresh from the reader share nothing but symbols, which
+   are never freed, so the cache can be written as they go. */
+lval *lmod_load(lenv *e, char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return lval_err("Could not import %s: %s", path, strerror(errno));
+    }
+    long size = st.st_size;
+    long mtime = lfile_mtime(&st);
+
+    char *cache = malloc(strlen(path) + 2);
+    sprintf(cache, "%sc", path);
+
+    long len = 0;
+    char *data = lfile_map(cache, &len);
+    limg_in r = {data, data + len};
+    long csize = -1, cmtime = -1, csum = 0;
+    int cached = data && limg_open(&r, LMOD_MAGIC)
+        && limg_get_long(&r, &csize) && limg_get_long(&r, &cmtime)
+        && limg_get_long(&r, &csum) && csize == size;
+
+    long srclen = 0;
+    char *src = NULL;
+    unsigned long sum = 0;
+    if (!cached || cmtime != mtime) {
+        src = lfile_map(path, &srclen);
+        if (!src) {
+            if (data) {lfile_unmap(data, len);}
+            free(cache);
+            return lval_err("Could not import %s: %s",
+                            path, strerror(errno));
+        }
+        sum = limg_sum(src, srclen);
+        cached = cached && (unsigned long)csum == sum && srclen == size;
+
+        /* the same text with a new time: keep the cache, with the time */
+        if (cached) {
+            limg_buf b = {0};
+            limg_put_long(&b, size);
+            limg_put_long(&b, mtime);
+            limg_put_long(&b, sum);
+            limg_put(&b, r.p, r.end - r.p);
+            limg_write(cache, LMOD_MAGIC, &b);
+            limg_buf_free(&b);
+        }
+    }
 
-        /* Return empty list */
-        return lval_sexpr();
+    int safe = lgc.safe;
+    lgc.safe = 0;
+    lval *err = NULL;
+
+    if (cached) {
+        /* the symbols read are shared by later forms */
+        r.shared = lval_qexpr();
+        lgc_root(r.shared);
+        while (r.p < r.end) {
+            lval *x = limg_get_val(&r);
+            if (!x) {
+                err = lval_err("Could not import %s, %s is damaged",
+                               path, cache);
+                break;
+            }
+            lload_form(e, x, safe);
+        }
+        lgc_unroot();
     } else {
-        /* Get Parse Error as String */
-        char *err_msg = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
+        limg_buf b = {0};
+        limg_put_long(&b, srclen);
+        limg_put_long(&b, mtime);
+        limg_put_long(&b, sum);
+
+        lreader rd = {src, src + srclen, 1};
+        lval *x;
+        while ((x = lread_form(&rd))) {
+            if (lval_type(x) == LVAL_ERR) {
+                err = lval_err("Could not import %s, %s", path, x->err);
+                lval_del(x);
+                break;
+            }
+            limg_put_val(&b, x);
+            lload_form(e, x, safe);
+        }
+        lread_free(&rd);
 
-        /* Create new error message using it */
-        lval *err = lval_err("Could not load library %s", err_msg);
-        free(err_msg);
-        lval_del(a);
+        /* a cache that cannot be written is only a missed speed up */
+        if (!err) {limg_write(cache, LMOD_MAGIC, &b);}
+        limg_buf_free(&b);
+    }
+
+    lgc.safe = safe;
+    limg_in_free(&r);
+    if (data) {lfile_unmap(data, len);}
+    if (src) {lfile_unmap(src, srclen);}
+    free(cache);
+
+    return err ? err : lval_sexpr();
+}
 
-        /* Cleanup and return error */
+lval *builtin_import(lenv *e, lval *a) {
+    LASSERT_NUM("import", a, 1);
+    LASSERT_TYPE("import", a, 0, LVAL_STR);
+
+    char *path = lmod_resolve(a->cell[0]->str);
+    if (!path) {
+        lval *err = lval_err("Could not import %s: %s",
+                             a->cell[0]->str, strerror(errno));
+        lval_del(a);
         return err;
     }
+    lval_del(a);
+
+    /* a module is evaluated once, even if it imports itself */
+    if (!lmod_add(path)) {return lval_sexpr();}
+
+    lval *x = lmod_load(e, path);
+    if (lval_type(x) == LVAL_ERR) {lmod_remove(path);}
+    return x;
 }
 
 int main(int argc, char **argv )
 {
 
-    Number = mpc_new("number");
-    Symbol = mpc_new("symbol");
-    String = mpc_new("string");
-    Comment = mpc_new("comment");
-    Sexpr = mpc_new("sexpr");
-    Qexpr = mpc_new("qexpr");
-    Expr = mpc_new("expr");
-    Lispx = mpc_new("lispx");
-
-    mpca_lang(MPCA_LANG_DEFAULT,
-              "\
-number   : /-?[0-9]+/ ;											\
-symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;					\
-string   : /\"(\\\\.|[^\"])*\"/ ;								\
-comment  : /;[^\\r\\n]*/ ;										\
-sexpr    : '(' <expr>* ')' ;									\
-qexpr    : '{' <expr>* '}' ;									\
-expr     : <number> | <symbol> | <string>						\
-         | <comment> | <sexpr> | <qexpr> ;						\
-lispx    : /^/ <expr>* /$/ ;									\
-",
-              Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispx);
-
     puts("lispx Version 0.0.1");
     puts("Press Ctrl+c to exit\n");
 
+    lsym_amp = lsym_intern("&");
+    lsym_if = lsym_intern("if");
+    lsym_do = lsym_intern("do");
+    lsym_let = lsym_intern("let");
+
+    lgc_init();
+
     lenv *e = lenv_new();
+    lgc.env = e;
     lenv_add_builtins(e);
 
     /* Supplied with list of files */
     if (argc >= 2) {
+        char *image = NULL;
+
         /* loop over each supplied filename (starting from 1) */
         for (int i = 1; i < argc; i++) {
+            /* run lambda bodies with the tree walker instead of the vm */
+            if (strcmp(argv[i], "--tree-walk") == 0) {
+                lvm.enabled = 0;
+                continue;
+            }
+
+            /* load the next file through an image, see limg_load */
+            if (strcmp(argv[i], "--image") == 0 && i + 2 < argc) {
+                image = argv[++i];
+                continue;
+            }
+
             /*Argument list with a single argument, the filename */
-            lval *args = lval_add(lval_sexpr(), lval_str(argv[1]));
+            lval *args = lval_add(lval_sexpr(), lval_str(argv[i]));
 
             /*Pass to builtin load and get the result*/
-            lval *x = builtin_load(e, args);
+            lgc.safe = 1;
+            lval *x;
+            if (image) {
+                lval_del(args);
+                x = limg_load(e, image, argv[i]);
+                image = NULL;
+            } else {
+                x = builtin_load(e, args);
+            }
+            lgc.safe = 0;
 
             /*If the result is an error be sure to print it*/
-            if (x->type == LVAL_ERR) {lval_println(x);}
+            if (lval_type(x) == LVAL_ERR) {lval_println(x);}
             lval_del(x);
+
+            /* a file loaded here is not imported again */
+            char *path = lmod_resolve(argv[i]);
+            if (path) {lmod_add(path);}
         }
     }
 
     while(1) {
         char *input = readline("lispx>");
-        add_history(input);
-
-        mpc_result_t r;
-        if(mpc_parse("<stdin>", input, Lispx, &r)) {
-//#define DEBUG
-#ifdef DEBUG
-            /* load ast from output */
-            mpc_ast_t *a = r.output;
-            printf("number_of_nodes: %i\n", number_of_nodes(a));
-            printf("Tag: %s\n", a->tag);
-            printf("Contents: %s\n", a->contents);
-            printf("Number of children: %i\n", a->children_num);
-
-            /* get first child */
-            mpc_ast_t *c0 = a->children[0];
-            printf("First Child Tag: %s\n", c0->tag);
-            printf("First Child Contents: %s\n", c0->contents);
-            printf("First Child Number of children: %i\n", c0->children_num);
-
-            mpc_ast_print(r.output);
-#endif
 
-            lval *x = lval_eval(e, lval_read(r.output));
-            lval_println(x);
-            lval_del(x);
+        /* the end of input, such as a piped script running out, ends
+           the session */
+        if (!input) {break;}
+        add_history(input);
 
-            mpc_ast_delete(r.output);
-        } else {
-            mpc_err_print(r.error);
-            mpc_err_delete(r.error);
-        }
+        /* a syntax error reads as an error, and evaluates to itself */
+        lval *v = lval_read(input);
+        lval *x = lval_eval(e, v);
+        lval_println(x);
+        lval_del(x);
+        lval_del(v);
+        lgc_safepoint();
 
         free(input);
     }
     lenv_del(e);
-    mpc_cleanup(8,
-                Number, Symbol, String, Comment,
-                Sexpr, Qexpr, Expr, Lispx);
 
     return 0;
 }
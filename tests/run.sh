@@ -0,0 +1,28 @@
+#!/bin/sh
+# Run every tests/test-*.sh against one lispx binary, from the top of
+# the tree so that (load "stdlib.lispx") finds the standard library.
+#
+# usage: sh tests/run.sh [lispx]
+
+LISPX=${1:-./lispx}
+case $LISPX in
+    /*) ;;
+    *) LISPX=$PWD/$LISPX ;;
+esac
+
+cd "$(dirname "$0")/.." || exit 1
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+export LISPX TMP
+
+failed=0
+for t in tests/test-*.sh; do
+    echo "== $t"
+    sh "$t" || failed=$((failed + 1))
+done
+
+if [ $failed -ne 0 ]; then
+    echo "$failed test script(s) failed"
+    exit 1
+fi
+echo "all tests passed"
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Write a Lisp program of about $1 megabytes to stdout: rule definitions
+# and 200-item tables, with a count of the rules kept as it goes and
+# printed at the end.
+#
+# usage: sh tests/stream/generate.sh MEGABYTES > FILE
+
+awk -v mb="${1:-64}" 'BEGIN {
+    limit = mb * 1048576
+    print "(def {rules} 0)"
+    for (i = 0; bytes < limit; i++) {
+        line = sprintf("(def {rule} {if (> x %d) {+ x %d} " \
+                       "{\"label-%d\" (* y %d)}})", i, i % 7, i, i % 3)
+        line = line "\n(def {rules} (+ rules 1))"
+        if (i % 100 == 0) {
+            table = "(def {table} {"
+            for (j = 0; j < 200; j++) table = table (i + j) " "
+            line = line "\n" table "})"
+        }
+        print line
+        bytes += length(line) + 1
+    }
+    print "(print \"loaded\" rules \"rules\")"
+}'
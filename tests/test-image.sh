@@ -0,0 +1,35 @@
+#!/bin/sh
+# A file loaded through --image is restored from the image on the next
+# run, modules it imported included: importing one of them again must
+# not evaluate it again, as after loading the file itself.
+
+cat > "$TMP/mod.lispx" << EOF
+(print "mod loaded")
+(def {m} 42)
+EOF
+cat > "$TMP/main.lispx" << EOF
+(import "$TMP/mod")
+(print "main loaded")
+EOF
+printf '(def {m} 1)\n(import "%s/mod")\nm\n' "$TMP" > "$TMP/image.in"
+
+status=0
+for run in load restore; do
+    "$LISPX" --image "$TMP/main.img" "$TMP/main.lispx" < "$TMP/image.in" \
+        > "$TMP/image.out" 2>&1
+    rc=$?
+    loaded=$(grep -c '^"main loaded"' "$TMP/image.out")
+    m=$(tail -n 1 "$TMP/image.out" | sed 's/ *$//')
+
+    if [ $rc -ne 0 ] || [ "$m" != 1 ]; then
+        echo "FAIL image $run: exit status $rc, m is $m"
+        status=1
+    elif [ $run = restore ] && [ "$loaded" -ne 0 ]; then
+        echo "FAIL image $run: the file was loaded again"
+        status=1
+    else
+        echo "ok   image $run"
+    fi
+done
+
+exit $status
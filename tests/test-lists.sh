@@ -0,0 +1,22 @@
+#!/bin/sh
+# The list builtins must give what the Lisp definitions they replaced
+# gave. tests/lists/conformance.lispx checks their values and prints
+# the errors of each in turn; its output, with the vm and with the tree
+# walker, must match conformance.out.
+
+status=0
+for mode in "" --tree-walk; do
+    f=tests/lists/conformance.lispx
+    "$LISPX" $mode "$f" < /dev/null > "$TMP/lists.out" 2>&1
+    tail -n +4 "$TMP/lists.out" | sed 's/ *$//' > "$TMP/lists.got"
+
+    if ! cmp -s "$TMP/lists.got" "${f%.lispx}.out"; then
+        echo "FAIL $f $mode"
+        diff "${f%.lispx}.out" "$TMP/lists.got" | head -20
+        status=1
+    else
+        echo "ok   $f $mode"
+    fi
+done
+
+exit $status
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Loading a file streams it, form by form, so memory stays bounded by
+# the largest form rather than the size of the file. Load a generated
+# file of LOAD_MB megabytes and check that the peak resident size of
+# the process, which the file prints as its last form, stays under
+# LOAD_MAX_RSS_MB, a fraction of the file.
+
+LOAD_MB=${LOAD_MB:-128}
+LOAD_MAX_RSS_MB=${LOAD_MAX_RSS_MB:-32}
+
+f=$TMP/load.lispx
+sh tests/stream/generate.sh "$LOAD_MB" > "$f"
+echo '(print "peak" (gc-stats {rss-peak-kb}))' >> "$f"
+rules=$(grep -c "^(def {rule}" "$f")
+
+"$LISPX" "$f" < /dev/null > "$TMP/load.out" 2>&1
+rc=$?
+
+got=$(grep '^"loaded"' "$TMP/load.out" | sed 's/ *$//')
+if [ $rc -ne 0 ] || [ "$got" != "\"loaded\" $rules \"rules\"" ]; then
+    echo "FAIL streaming load of $LOAD_MB MB: exit status $rc"
+    tail -n 5 "$TMP/load.out"
+    exit 1
+fi
+
+peak=$(sed -n 's/^"peak" {\([0-9]*\)}.*/\1/p' "$TMP/load.out")
+if [ -z "$peak" ] || [ $((peak / 1024)) -ge "$LOAD_MAX_RSS_MB" ]; then
+    echo "FAIL streaming load of $LOAD_MB MB: peak RSS ${peak:-?} kB," \
+         "limit $LOAD_MAX_RSS_MB MB"
+    exit 1
+fi
+echo "ok   streaming load of $LOAD_MB MB, peak RSS $((peak / 1024)) MB"
@@ -0,0 +1,86 @@
+#!/bin/sh
+# Nesting a million levels deep must neither crash nor run out of C
+# stack, in the reader, printer, evaluator, comparison or when freeing:
+# a literal and an expression each nested 10^6 deep, generated here,
+# must read, evaluate and print. Recursion that never ends must stop at
+# the depth limits with an error.
+
+N=1000000
+
+awk -v n=$N 'BEGIN {
+    for (i = 0; i < n; i++) printf "{"
+    printf "1"
+    for (i = 0; i < n; i++) printf "}"
+    print ""
+}' > "$TMP/literal.txt"
+{
+    printf '(def {a} %s)\n' "$(cat "$TMP/literal.txt")"
+    echo '(print a)'
+    echo '(print (== a a))'
+} > "$TMP/literal.lispx"
+
+awk -v n=$N 'BEGIN {
+    printf "(print "
+    for (i = 0; i < n; i++) printf "(+ 1 "
+    printf "0"
+    for (i = 0; i < n; i++) printf ")"
+    print ")"
+}' > "$TMP/expr.lispx"
+
+# the vm and the tree walker stop unbounded recursion at different limits
+cat > "$TMP/recursion.vm" <<EOF2
+1000
+Error: Maximum depth of 2097152 nested calls exceeded.
+Error: Maximum depth of 10000 nested evaluations exceeded.
+Error: Maximum depth of 10000 nested evaluations exceeded.
+"still here"
+EOF2
+cat > "$TMP/recursion.tw" <<EOF2
+1000
+Error: Maximum depth of 10000 nested evaluations exceeded.
+Error: Maximum depth of 10000 nested evaluations exceeded.
+Error: Maximum depth of 10000 nested evaluations exceeded.
+"still here"
+EOF2
+
+# run file $1 with mode $2, leaving what it printed in $TMP/stress.got
+run() {
+    "$LISPX" $2 "$1" < /dev/null > "$TMP/stress.out" 2>&1
+    rc=$?
+    tail -n +4 "$TMP/stress.out" | sed 's/ *$//' > "$TMP/stress.got"
+    return $rc
+}
+
+status=0
+for mode in "" --tree-walk; do
+    if run "$TMP/literal.lispx" "$mode" &&
+       head -n 1 "$TMP/stress.got" | cmp -s - "$TMP/literal.txt" &&
+       [ "$(tail -n +2 "$TMP/stress.got")" = 1 ]; then
+        echo "ok   literal nested $N deep $mode"
+    else
+        echo "FAIL literal nested $N deep $mode"
+        status=1
+    fi
+
+    if run "$TMP/expr.lispx" "$mode" &&
+       [ "$(cat "$TMP/stress.got")" = $N ]; then
+        echo "ok   expression nested $N deep $mode"
+    else
+        echo "FAIL expression nested $N deep $mode"
+        head -c 200 "$TMP/stress.got"
+        status=1
+    fi
+
+    expect=$TMP/recursion.vm
+    [ -n "$mode" ] && expect=$TMP/recursion.tw
+    if run tests/stress/recursion.lispx "$mode" &&
+       cmp -s "$TMP/stress.got" "$expect"; then
+        echo "ok   tests/stress/recursion.lispx $mode"
+    else
+        echo "FAIL tests/stress/recursion.lispx $mode"
+        diff "$expect" "$TMP/stress.got" | head -20
+        status=1
+    fi
+done
+
+exit $status
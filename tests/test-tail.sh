@@ -0,0 +1,26 @@
+#!/bin/sh
+# Tail calls run in place of the calling frame in the vm, so a loop
+# written as tail recursion runs in constant stack: a fold over a
+# million-element list must finish without a depth error, and so must a
+# loop of more iterations than the LMAX_DEPTH frames the vm allows.
+# The tree walker still nests C calls for lambda calls and stops at
+# LMAX_NEST, so this only runs with the vm.
+
+status=0
+for f in tests/tail/*.lispx; do
+    "$LISPX" "$f" < /dev/null > "$TMP/tail.out" 2>&1
+    tail -n +4 "$TMP/tail.out" | sed 's/ *$//' > "$TMP/tail.got"
+
+    if grep -q "Maximum depth" "$TMP/tail.got"; then
+        echo "FAIL $f: hit the depth limit"
+        status=1
+    elif ! cmp -s "$TMP/tail.got" "${f%.lispx}.out"; then
+        echo "FAIL $f: unexpected output"
+        diff "${f%.lispx}.out" "$TMP/tail.got" | head -20
+        status=1
+    else
+        echo "ok   $f"
+    fi
+done
+
+exit $status
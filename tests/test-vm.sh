@@ -0,0 +1,29 @@
+#!/bin/sh
+# The bytecode vm and the tree walker (--tree-walk) must agree: run each
+# program in tests/vm through both and compare everything they print.
+#
+# Two differences are intended and kept out of these programs: lambda
+# calls in the vm do not use the C stack, so it recurses past LMAX_NEST
+# where the tree walker gives an error, and only the vm counts inline
+# cache hits in (gc-stats).
+
+status=0
+for f in tests/vm/*.lispx; do
+    "$LISPX" < "$f" > "$TMP/vm.out" 2>&1
+    vm=$?
+    "$LISPX" --tree-walk < "$f" > "$TMP/tw.out" 2>&1
+    tw=$?
+
+    if [ $vm -ne 0 ] || [ $tw -ne 0 ]; then
+        echo "FAIL $f: exit status $vm with the vm, $tw without"
+        status=1
+    elif ! cmp -s "$TMP/vm.out" "$TMP/tw.out"; then
+        echo "FAIL $f: the vm and the tree walker differ"
+        diff "$TMP/vm.out" "$TMP/tw.out" | head -20
+        status=1
+    else
+        echo "ok   $f"
+    fi
+done
+
+exit $status